@@ -0,0 +1,504 @@
+/******************************************************************************
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * Trace statistics for --analyze.
+ *
+ * For each register (as reginfo_visit() describes them) we count how
+ * many checkpoints changed it, for flag registers how often each bit
+ * is set, and for FP and SIMD registers how many lanes hold zeros,
+ * denormals, normal numbers, infinities and NaNs. Checkpoints are also
+ * counted by PC range, with the register changes seen at them.
+ *
+ * The main thread reads the trace and hands its register records to
+ * worker threads in batches. Each worker keeps its own counts, which
+ * are added up at the end; a batch carries the record before its
+ * first so that changes across batch boundaries are counted too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "risu.h"
+
+#define BATCH_RECORDS   256
+#define MAX_WORKERS     16
+#define QUEUE_LEN       (2 * MAX_WORKERS)
+#define MAX_REGS        4096
+#define MAX_PC_BUCKETS  (1 << 20)
+
+enum { FC_ZERO, FC_DENORMAL, FC_NORMAL, FC_INF, FC_NAN, NCLASSES };
+
+static const char *const class_name[] = {
+    [RISU_REG_INT] = "int",
+    [RISU_REG_FLAGS] = "flags",
+    [RISU_REG_FP] = "fp",
+    [RISU_REG_VEC] = "vec",
+};
+
+static const char *const fpclass_name[NCLASSES] = {
+    "zero", "denormal", "normal", "inf", "nan"
+};
+
+typedef struct {
+    char *name;
+    RisuRegClass cls;
+    size_t size;
+} RegDesc;
+
+typedef struct {
+    uint64_t changes;
+    uint64_t bits[64];
+    uint64_t f32[NCLASSES], f64[NCLASSES];
+} RegStats;
+
+typedef struct {
+    uint64_t checkpoints, changes;
+} PcStats;
+
+typedef struct {
+    uint64_t other_layout;      /* records with a different register set */
+    RegStats *regs;
+    PcStats *pcs;
+    size_t npcs;
+    uint64_t pcs_beyond;
+} Stats;
+
+typedef struct {
+    size_t n;
+    bool has_prev;              /* the first record is the previous one */
+    size_t offset[BATCH_RECORDS + 2];
+    uintptr_t pc[BATCH_RECORDS + 1];
+    uint8_t *data;
+    size_t cap;
+} Batch;
+
+/* One register of a record, as collected by reginfo_visit(). */
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+} RegView;
+
+typedef struct {
+    RegView *regs;
+    size_t n;
+    bool overflow;
+} RecordView;
+
+static size_t pc_bucket = 256;
+/* Records of each op; OP_SIGILL is -1. */
+#define NOPS            (OP_BENCHLOOP + 2)
+static uint64_t nrecords, ops[NOPS];
+
+static RegDesc *layout;
+static size_t nlayout;
+
+static Batch *current;
+static uint8_t *last_record;    /* the previous register record */
+static size_t last_size;
+
+static pthread_t workers[MAX_WORKERS];
+static Stats worker_stats[MAX_WORKERS];
+static int nworkers;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static Batch *queue[QUEUE_LEN];
+static int queue_head, queue_count;
+
+static void *xmalloc(size_t size)
+{
+    void *p = calloc(1, size);
+
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+static void collect_layout(void *opaque, const char *name, RisuRegClass cls,
+                           const void *data, size_t size)
+{
+    if (nlayout < MAX_REGS) {
+        layout[nlayout].name = strdup(name);
+        layout[nlayout].cls = cls;
+        layout[nlayout].size = size;
+        nlayout++;
+    }
+}
+
+static void collect_view(void *opaque, const char *name, RisuRegClass cls,
+                         const void *data, size_t size)
+{
+    RecordView *v = opaque;
+
+    if (v->n < nlayout && layout[v->n].size == size) {
+        v->regs[v->n].data = data;
+        v->regs[v->n].size = size;
+    } else {
+        v->overflow = true;
+    }
+    v->n++;
+}
+
+static int classify(uint64_t exp, uint64_t expmax, uint64_t frac)
+{
+    if (exp == 0) {
+        return frac ? FC_DENORMAL : FC_ZERO;
+    }
+    if (exp == expmax) {
+        return frac ? FC_NAN : FC_INF;
+    }
+    return FC_NORMAL;
+}
+
+static void count_register(RegStats *rs, RisuRegClass cls, const RegView *r)
+{
+    size_t i;
+
+    if (cls == RISU_REG_FLAGS) {
+        uint64_t v = 0;
+
+        memcpy(&v, r->data, r->size < 8 ? r->size : 8);
+        while (v) {
+            rs->bits[__builtin_ctzll(v)]++;
+            v &= v - 1;
+        }
+        return;
+    }
+    if (cls == RISU_REG_VEC) {
+        for (i = 0; i + 4 <= r->size; i += 4) {
+            uint32_t v;
+
+            memcpy(&v, r->data + i, 4);
+            rs->f32[classify((v >> 23) & 0xff, 0xff, v & 0x7fffff)]++;
+        }
+    }
+    if (cls == RISU_REG_VEC || cls == RISU_REG_FP) {
+        for (i = 0; i + 8 <= r->size; i += 8) {
+            uint64_t v;
+
+            memcpy(&v, r->data + i, 8);
+            rs->f64[classify((v >> 52) & 0x7ff, 0x7ff,
+                             v & ((1ull << 52) - 1))]++;
+        }
+    }
+}
+
+static PcStats *pc_stats(Stats *st, size_t b)
+{
+    if (b >= st->npcs) {
+        size_t n = b + 1 > st->npcs * 2 ? b + 1 : st->npcs * 2;
+
+        st->pcs = realloc(st->pcs, n * sizeof(PcStats));
+        if (!st->pcs) {
+            abort();
+        }
+        memset(st->pcs + st->npcs, 0, (n - st->npcs) * sizeof(PcStats));
+        st->npcs = n;
+    }
+    return &st->pcs[b];
+}
+
+static void count_pc(Stats *st, uintptr_t pc, uint64_t changes)
+{
+    PcStats *p;
+
+    if (pc / pc_bucket >= MAX_PC_BUCKETS) {
+        st->pcs_beyond++;
+        return;
+    }
+    p = pc_stats(st, pc / pc_bucket);
+    p->checkpoints++;
+    p->changes += changes;
+}
+
+static void process_batch(Stats *st, Batch *b, RecordView *v, RecordView *pv)
+{
+    bool have_prev = false;
+    size_t i, j;
+
+    for (i = 0; i < b->n + b->has_prev; i++) {
+        struct reginfo *ri = (struct reginfo *)(b->data + b->offset[i]);
+        bool is_prev = b->has_prev && i == 0;
+        uint64_t changes = 0;
+        RecordView *t;
+
+        v->n = 0;
+        v->overflow = false;
+        reginfo_visit(ri, collect_view, v);
+        if (v->overflow || v->n != nlayout) {
+            if (!is_prev) {
+                st->other_layout++;
+            }
+            have_prev = false;
+            continue;
+        }
+        if (!is_prev) {
+            for (j = 0; j < nlayout; j++) {
+                if (have_prev &&
+                    memcmp(v->regs[j].data, pv->regs[j].data,
+                           v->regs[j].size) != 0) {
+                    st->regs[j].changes++;
+                    changes++;
+                }
+                count_register(&st->regs[j], layout[j].cls, &v->regs[j]);
+            }
+            count_pc(st, b->pc[i - b->has_prev], changes);
+        }
+        t = pv;
+        pv = v;
+        v = t;
+        have_prev = true;
+    }
+}
+
+static void *worker(void *opaque)
+{
+    Stats *st = opaque;
+    RecordView v = { .regs = xmalloc(nlayout * sizeof(RegView)) };
+    RecordView pv = { .regs = xmalloc(nlayout * sizeof(RegView)) };
+
+    st->regs = xmalloc(nlayout * sizeof(RegStats));
+    for (;;) {
+        Batch *b;
+
+        pthread_mutex_lock(&queue_lock);
+        while (queue_count == 0) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        b = queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_LEN;
+        queue_count--;
+        pthread_cond_broadcast(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+
+        if (!b) {
+            break;
+        }
+        process_batch(st, b, &v, &pv);
+        free(b->data);
+        free(b);
+    }
+    free(v.regs);
+    free(pv.regs);
+    return NULL;
+}
+
+static void push_batch(Batch *b)
+{
+    pthread_mutex_lock(&queue_lock);
+    while (queue_count == QUEUE_LEN) {
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    queue[(queue_head + queue_count) % QUEUE_LEN] = b;
+    queue_count++;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void start_workers(struct reginfo *first)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    layout = xmalloc(MAX_REGS * sizeof(RegDesc));
+    reginfo_visit(first, collect_layout, NULL);
+
+    nworkers = ncpus < 1 ? 1 : ncpus > MAX_WORKERS ? MAX_WORKERS : ncpus;
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i], NULL, worker, &worker_stats[i])) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* Append size bytes of record to b, 16-aligned for the reginfo. */
+static void batch_add(Batch *b, const void *record, size_t size)
+{
+    size_t i = b->n + b->has_prev;
+    size_t off = b->offset[i];
+
+    if (off + size > b->cap) {
+        b->cap = (off + size) * 2;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) {
+            abort();
+        }
+    }
+    memcpy(b->data + off, record, size);
+    b->offset[i + 1] = off + ((size + 15) & ~(size_t)15);
+}
+
+void analyze_set_pc_bucket(size_t bytes)
+{
+    pc_bucket = bytes;
+}
+
+void analyze_record(const trace_header_t *header, struct reginfo *ri)
+{
+    nrecords++;
+    ops[header->risu_op + 1]++;
+
+    switch (header->risu_op) {
+    case OP_COMPARE:
+    case OP_TESTEND:
+    case OP_SIGILL:
+        break;
+    default:
+        return;
+    }
+
+    if (!layout) {
+        start_workers(ri);
+    }
+    if (!current) {
+        current = xmalloc(sizeof(*current));
+        if (last_record) {
+            current->has_prev = true;
+            batch_add(current, last_record, last_size);
+        }
+    }
+    current->pc[current->n] = header->pc;
+    batch_add(current, ri, header->size);
+    current->n++;
+
+    if (current->n == BATCH_RECORDS) {
+        size_t i = current->n - 1 + current->has_prev;
+
+        free(last_record);
+        last_size = header->size;
+        last_record = xmalloc(last_size);
+        memcpy(last_record, current->data + current->offset[i], last_size);
+        push_batch(current);
+        current = NULL;
+    }
+}
+
+static void print_classes(FILE *f, const char *what, const uint64_t *c)
+{
+    int i;
+
+    fprintf(f, ",\"%s\":{", what);
+    for (i = 0; i < NCLASSES; i++) {
+        fprintf(f, "%s\"%s\":%" PRIu64, i ? "," : "", fpclass_name[i], c[i]);
+    }
+    fprintf(f, "}");
+}
+
+int analyze_report(FILE *f)
+{
+    Stats total = { 0 };
+    size_t i, j;
+    int w, k;
+    bool first;
+
+    if (current) {
+        push_batch(current);
+        current = NULL;
+    }
+    for (w = 0; w < nworkers; w++) {
+        push_batch(NULL);
+    }
+    for (w = 0; w < nworkers; w++) {
+        pthread_join(workers[w], NULL);
+    }
+
+    total.regs = xmalloc((nlayout ? nlayout : 1) * sizeof(RegStats));
+    for (w = 0; w < nworkers; w++) {
+        Stats *st = &worker_stats[w];
+
+        total.other_layout += st->other_layout;
+        total.pcs_beyond += st->pcs_beyond;
+        for (j = 0; j < nlayout; j++) {
+            RegStats *a = &total.regs[j], *b = &st->regs[j];
+
+            a->changes += b->changes;
+            for (k = 0; k < 64; k++) {
+                a->bits[k] += b->bits[k];
+            }
+            for (k = 0; k < NCLASSES; k++) {
+                a->f32[k] += b->f32[k];
+                a->f64[k] += b->f64[k];
+            }
+        }
+        for (i = 0; i < st->npcs; i++) {
+            if (st->pcs[i].checkpoints) {
+                PcStats *p = pc_stats(&total, i);
+
+                p->checkpoints += st->pcs[i].checkpoints;
+                p->changes += st->pcs[i].changes;
+            }
+        }
+        free(st->regs);
+        free(st->pcs);
+    }
+
+    fprintf(f, "{\"records\":%" PRIu64 ",\"ops\":{", nrecords);
+    first = true;
+    for (k = 0; k < NOPS; k++) {
+        if (ops[k]) {
+            fprintf(f, "%s\"%s\":%" PRIu64, first ? "" : ",",
+                    op_name(k - 1), ops[k]);
+            first = false;
+        }
+    }
+    fprintf(f, "},\"other_register_sets\":%" PRIu64 ",\n\"registers\":[\n",
+            total.other_layout);
+
+    for (j = 0; j < nlayout; j++) {
+        RegStats *rs = &total.regs[j];
+
+        fprintf(f, "{\"name\":\"%s\",\"class\":\"%s\",\"changes\":%" PRIu64,
+                layout[j].name, class_name[layout[j].cls], rs->changes);
+        switch (layout[j].cls) {
+        case RISU_REG_FLAGS:
+            fprintf(f, ",\"bits_set\":{");
+            first = true;
+            for (k = 0; k < 64; k++) {
+                if (rs->bits[k]) {
+                    fprintf(f, "%s\"%d\":%" PRIu64, first ? "" : ",",
+                            k, rs->bits[k]);
+                    first = false;
+                }
+            }
+            fprintf(f, "}");
+            break;
+        case RISU_REG_VEC:
+            print_classes(f, "f32", rs->f32);
+            /* fall through */
+        case RISU_REG_FP:
+            print_classes(f, "f64", rs->f64);
+            break;
+        default:
+            break;
+        }
+        fprintf(f, "}%s\n", j + 1 < nlayout ? "," : "");
+    }
+
+    fprintf(f, "],\n\"pc_range_bytes\":%zu,\"pc_ranges\":[", pc_bucket);
+    first = true;
+    for (i = 0; i < total.npcs; i++) {
+        if (total.pcs[i].checkpoints) {
+            fprintf(f, "%s\n{\"start\":\"%#zx\",\"checkpoints\":%" PRIu64
+                    ",\"changes\":%" PRIu64 "}", first ? "" : ",",
+                    i * pc_bucket, total.pcs[i].checkpoints,
+                    total.pcs[i].changes);
+            first = false;
+        }
+    }
+    fprintf(f, "\n],\"pcs_beyond_ranges\":%" PRIu64 "}\n", total.pcs_beyond);
+
+    free(total.regs);
+    free(total.pcs);
+    return ferror(f) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,136 @@
+/******************************************************************************
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * Content-defined chunking for risu-store (risu --chunk).
+ *
+ * The input is cut into chunks at points chosen by a gear hash of the
+ * bytes before them, so that an insertion or deletion only changes
+ * the chunks around it and a trace which shares a stretch with one
+ * already stored reuses its chunks. Each chunk is written out as its
+ * length in decimal on a line of its own followed by its bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "risu.h"
+
+#define MINCHUNK        2048
+#define MAXCHUNK        65536
+#define CHUNKMASK       0x1fff  /* 8K average */
+
+/*
+ * The first 32 bits of sha256("risu-store gear N") for each byte N.
+ * The table is fixed and must not change: the chunk boundaries of
+ * every trace already stored depend on it.
+ */
+static const uint32_t gear[256] = {
+    0xf9ff5182, 0x5bca2d0b, 0x7cba6ebd, 0x2bccacda,
+    0x14dfa21d, 0xe449ff0d, 0x2375e2c1, 0xd1fab9f7,
+    0xc11b7791, 0x3d434238, 0x53f87f11, 0x0f6b3d89,
+    0x569feb31, 0x23067541, 0x3168fbfb, 0x90660099,
+    0x40906032, 0x483434ec, 0x02cd2538, 0x83dec192,
+    0xf659d11a, 0xc35e42d0, 0xb001bc2b, 0xee940d83,
+    0xf61ed741, 0x1d9de4af, 0x45cd27a9, 0x5e9b9c0f,
+    0xf98ff82a, 0xd370e2cc, 0x974dbbf7, 0x18a316c8,
+    0x256feb84, 0x5873a701, 0x28094e23, 0x4a1bf393,
+    0x69b85ba3, 0x33f47d53, 0x40425c7d, 0xb73aa732,
+    0xe970f4de, 0xdc2f5b4a, 0xc63ca898, 0x6817be11,
+    0x0c899833, 0x92121e52, 0x5cd8cee2, 0xbd17644a,
+    0x712a62e3, 0xdc78c6f4, 0xeefc551c, 0xa9ae5273,
+    0xf0963492, 0x441d904e, 0x5c4d989d, 0xd2dd07ac,
+    0x75df793c, 0x9f463890, 0x9ce1aeef, 0xaeffe3bb,
+    0xb94c94a8, 0x418ec1b5, 0x4f2d5dd4, 0x548d27c3,
+    0x1b44c765, 0xf35acce1, 0xbf9c222d, 0x6a17e41e,
+    0x2c4ca12b, 0x6eb219f3, 0x28e9568f, 0xe41efde4,
+    0x3b578d65, 0x07c6e345, 0x3f870eca, 0x742717c2,
+    0x73fdc176, 0x73e4e17d, 0xbc350ecb, 0x547d0e68,
+    0x2b50cc67, 0xe78746ed, 0x397c04c8, 0x392148fd,
+    0x404b509b, 0x35a0d63f, 0x6c1cf532, 0x846eb1c5,
+    0x7b32ec18, 0xa8dff80e, 0xa12d99f6, 0xeb4e858f,
+    0xe9de2da9, 0x877a865f, 0x17f3e7a9, 0x82085269,
+    0x483d4c29, 0xb6acc56b, 0xf4ddd37d, 0x75ed515a,
+    0x344bc641, 0xabba5346, 0x3c0873a4, 0x5984b78d,
+    0xe12130e5, 0x08be4838, 0x9bf6be45, 0xa62c2e9e,
+    0x2d690873, 0xd17a78b6, 0x7a2d684a, 0xa2c0ff1f,
+    0xd36cbd0d, 0x733eb79b, 0xe56a1693, 0x371dddc4,
+    0xf65cd8cf, 0xe80747ff, 0xa3f970d6, 0x1f83d7d0,
+    0x0899ec87, 0x334745cb, 0xc78fac45, 0x66638de4,
+    0x265ee750, 0x3a679bac, 0x8cfd93d6, 0x700ee0e6,
+    0x2af8a819, 0xb48c82ab, 0x7deb9fd2, 0x0f24292c,
+    0x9225975e, 0x52e1708b, 0x28d28a51, 0x2bf88d10,
+    0x7d13e4c6, 0xe1c530f0, 0xda18299e, 0xaa43d883,
+    0x81974fc8, 0x834c17ce, 0xaa2c833f, 0x2b2022b2,
+    0x045ce870, 0xa38804ff, 0x9ffc55ff, 0x6dc6d3d4,
+    0x4506d4bd, 0x85249731, 0x56c4f331, 0xb32bd494,
+    0xe103303d, 0xb97a075f, 0x861ff2db, 0xcfc23094,
+    0x8cb5d75e, 0x48375b2b, 0x506c4dae, 0xeba4897d,
+    0xce770ef5, 0x4d952c81, 0xdbd68cdd, 0x923243ab,
+    0x3531e350, 0xdb040d52, 0x132a6d15, 0xdf98cca2,
+    0x1b5def69, 0x69fabd46, 0xfbd1b3f9, 0xc8938546,
+    0x0f00a179, 0x5e5c746d, 0xfa307084, 0x9354f8bd,
+    0x13126d7e, 0x8e666870, 0x302fdf6f, 0xa375e0cd,
+    0xdeb505dc, 0x49cd5c8e, 0xb4f16020, 0xad74b644,
+    0x18cf40b5, 0x1dc7a14c, 0xcdaad372, 0x0768ea47,
+    0x59fcb1a0, 0x9767a20e, 0x475a12dc, 0xddddfd33,
+    0x7111bb86, 0x75b8e911, 0x44c2e56b, 0x5ef16187,
+    0x35c0d6d6, 0x8f42e04d, 0x765dfbdc, 0x6e0aeb62,
+    0xa28388ff, 0x859a9052, 0x36732697, 0x15ee16a0,
+    0x83d9c221, 0xe57dd5cd, 0xc225cc0c, 0x82fdf5c1,
+    0xeca531e4, 0x7134c165, 0xa5a0c8e4, 0x9f3eca92,
+    0x0eed321c, 0x17a7a71e, 0x3104a95b, 0x27930ef3,
+    0xeadea5f9, 0xec8737c3, 0xc85a8658, 0xde4bf981,
+    0x05cfc077, 0x5dc9e2ba, 0xdff5d68f, 0xc743570a,
+    0x8a75bf6a, 0x2b02f86e, 0x51e33219, 0xeb921283,
+    0x7ec81c78, 0x2e1db14f, 0xb2955964, 0x1bf82499,
+    0x55fb0477, 0x381dbe19, 0x1d143c1f, 0x81525e54,
+    0xa56a1cb5, 0x15742df3, 0x4b52e8e2, 0xf4f08546,
+    0x02fec01f, 0xd771d0ab, 0x50fdff51, 0xd6b3d733,
+    0x906288b4, 0x3f64b17b, 0x0d0bd1ca, 0x9f82ceaa,
+    0x0dca9df8, 0x0c3205f6, 0x30cb9c58, 0x3f22baaf,
+    0x32161fba, 0x3ff91912, 0x35dde3ad, 0x12490365,
+};
+
+static bool put_chunk(FILE *out, const uint8_t *data, size_t len)
+{
+    return fprintf(out, "%zu\n", len) > 0 && fwrite(data, 1, len, out) == len;
+}
+
+int chunk_stream(FILE *in, FILE *out)
+{
+    static uint8_t buf[1 << 16], chunk[MAXCHUNK];
+    uint32_t h = 0;
+    size_t len = 0, n, i;
+
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        for (i = 0; i < n; i++) {
+            chunk[len++] = buf[i];
+            h = (h << 1) + gear[buf[i]];
+            if (len < MINCHUNK || ((h & CHUNKMASK) && len < MAXCHUNK)) {
+                continue;
+            }
+            if (!put_chunk(out, chunk, len)) {
+                perror("--chunk");
+                return EXIT_FAILURE;
+            }
+            h = 0;
+            len = 0;
+        }
+    }
+    if (ferror(in)) {
+        perror("--chunk");
+        return EXIT_FAILURE;
+    }
+    if ((len && !put_chunk(out, chunk, len)) || fflush(out) != 0) {
+        perror("--chunk");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
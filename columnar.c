@@ -0,0 +1,694 @@
+/******************************************************************************
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * Columnar traces.
+ *
+ * A trace is a sequence of records, each a trace_header_t and its
+ * payload (a reginfo or a memory block). From one record to the next
+ * most of that is unchanged, or changes by the same amount: the PC
+ * moves on a few bytes, most registers keep their values. A columnar
+ * trace takes the records a block at a time and stores each 64-bit
+ * word of them as a column: word N of every header is one column,
+ * word N of every payload of the same size another. Each column is
+ * stored as its differences from the previous record, whichever of
+ *
+ *   XOR:   v ^ prev
+ *   DELTA: v - prev
+ *   DOD:   (v - prev) - (prev - prevprev)
+ *
+ * comes out smallest, and those are bit-packed at the width of the
+ * largest, either densely or, when most are zero, as a bitmap of the
+ * non-zero ones followed by those. A column which doesn't change
+ * within a block takes one byte.
+ *
+ * The file is the magic and version, then blocks of
+ *
+ *   uint32_t nrecords, uint32_t len, len bytes of columns
+ *
+ * The columns are the header columns for all nrecords, then for each
+ * payload size in the order it first appears in the block, the
+ * columns for the records of that size. Reading gives back the
+ * records exactly as they were written.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "risu.h"
+
+#define COL_MAGIC       (('R' << 24) | ('C' << 16) | ('O' << 8) | 'L')
+#define COL_VERSION     1
+#define COL_BLOCK       1024            /* records per block */
+#define COL_MAXGROUPS   8               /* payload sizes per trace */
+#define COL_MAXPAYLOAD  (1 << 20)
+
+enum { MODE_XOR, MODE_DELTA, MODE_DOD, NMODES };
+enum { KIND_ZERO, KIND_DENSE, KIND_SPARSE };
+
+/* Predictor state for the columns of the header or of one payload size. */
+typedef struct {
+    uint32_t size;
+    size_t ncols;
+    uint64_t *prev, *prevdelta;
+} ColGroup;
+
+typedef struct {
+    uint8_t *data;
+    size_t len, cap;
+} ColBuf;
+
+struct ColTrace {
+    int fd;
+    bool writing;
+    ColGroup header;
+    ColGroup groups[COL_MAXGROUPS];
+    int ngroups;
+
+    /* The block's records as they appear in a row trace. */
+    ColBuf rows;
+    size_t offsets[COL_BLOCK + 1];
+    size_t nrecords;
+    size_t pos;                 /* reading: next byte of rows */
+
+    ColBuf enc;
+    uint64_t *vals, *res[NMODES];
+    size_t *members;
+};
+
+static void buf_reserve(ColBuf *b, size_t len)
+{
+    if (b->len + len > b->cap) {
+        b->cap = (b->len + len) * 2;
+        b->data = realloc(b->data, b->cap);
+        if (!b->data) {
+            abort();
+        }
+    }
+}
+
+static void buf_put(ColBuf *b, const void *data, size_t len)
+{
+    buf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* Bit-packing, least significant bit first. */
+typedef struct {
+    ColBuf *b;
+    uint64_t acc;
+    int n;
+} BitWriter;
+
+typedef struct {
+    const uint8_t *p, *end;
+    uint64_t acc;
+    int n;
+    bool overrun;
+} BitReader;
+
+static void put_bits(BitWriter *w, uint64_t v, int width)
+{
+    while (width > 0) {
+        int take = width < 32 ? width : 32;
+
+        w->acc |= (v & ((1ull << take) - 1)) << w->n;
+        w->n += take;
+        v >>= take;
+        width -= take;
+        while (w->n >= 8) {
+            uint8_t byte = w->acc;
+
+            buf_put(w->b, &byte, 1);
+            w->acc >>= 8;
+            w->n -= 8;
+        }
+    }
+}
+
+static void flush_bits(BitWriter *w)
+{
+    if (w->n) {
+        put_bits(w, 0, 8 - w->n);
+    }
+}
+
+static uint64_t get_bits(BitReader *r, int width)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    while (width > 0) {
+        int take = width < 32 ? width : 32;
+
+        while (r->n < take) {
+            if (r->p == r->end) {
+                r->overrun = true;
+                return 0;
+            }
+            r->acc |= (uint64_t)*r->p++ << r->n;
+            r->n += 8;
+        }
+        v |= (r->acc & ((1ull << take) - 1)) << shift;
+        r->acc >>= take;
+        r->n -= take;
+        shift += take;
+        width -= take;
+    }
+    return v;
+}
+
+static uint64_t zigzag(uint64_t d)
+{
+    return (d << 1) ^ -(d >> 63);
+}
+
+static uint64_t unzigzag(uint64_t z)
+{
+    return (z >> 1) ^ -(z & 1);
+}
+
+/* Word col of a record part of len bytes, zero-padded. */
+static uint64_t get_word(const uint8_t *p, size_t len, size_t col)
+{
+    uint64_t v = 0;
+    size_t off = col * 8;
+
+    memcpy(&v, p + off, len - off < 8 ? len - off : 8);
+    return v;
+}
+
+static void put_word(uint8_t *p, size_t len, size_t col, uint64_t v)
+{
+    size_t off = col * 8;
+
+    memcpy(p + off, &v, len - off < 8 ? len - off : 8);
+}
+
+static void group_init(ColGroup *g, uint32_t size)
+{
+    g->size = size;
+    g->ncols = (size + 7) / 8;
+    g->prev = calloc(g->ncols, sizeof(uint64_t));
+    g->prevdelta = calloc(g->ncols, sizeof(uint64_t));
+    if (!g->prev || !g->prevdelta) {
+        abort();
+    }
+}
+
+static ColGroup *find_group(ColTrace *ct, uint32_t size)
+{
+    int i;
+
+    for (i = 0; i < ct->ngroups; i++) {
+        if (ct->groups[i].size == size) {
+            return &ct->groups[i];
+        }
+    }
+    if (ct->ngroups == COL_MAXGROUPS) {
+        return NULL;
+    }
+    group_init(&ct->groups[ct->ngroups], size);
+    return &ct->groups[ct->ngroups++];
+}
+
+static uint32_t record_size(ColTrace *ct, size_t i)
+{
+    trace_header_t h;
+
+    memcpy(&h, ct->rows.data + ct->offsets[i], sizeof(h));
+    return h.size;
+}
+
+/* Bytes needed to store n residuals, and the width and kind to use. */
+static size_t encoded_size(const uint64_t *r, size_t n, int *width,
+                           int *kind)
+{
+    uint64_t all = 0;
+    size_t i, nonzero = 0, dense, sparse;
+
+    for (i = 0; i < n; i++) {
+        all |= r[i];
+        nonzero += r[i] != 0;
+    }
+    if (!all) {
+        *width = 0;
+        *kind = KIND_ZERO;
+        return 1;
+    }
+    *width = 64 - __builtin_clzll(all);
+    dense = 2 + (n * *width + 7) / 8;
+    sparse = 2 + (n + 7) / 8 + (nonzero * *width + 7) / 8;
+    *kind = sparse < dense ? KIND_SPARSE : KIND_DENSE;
+    return sparse < dense ? sparse : dense;
+}
+
+/*
+ * Encode column col of the n records listed in members, whose part
+ * of group g starts skip bytes into the record.
+ */
+static void encode_column(ColTrace *ct, ColGroup *g, size_t col,
+                          size_t n, size_t skip)
+{
+    uint64_t prev = g->prev[col], pd = g->prevdelta[col];
+    size_t i, best = 0, bestsize = SIZE_MAX;
+    int mode, width = 0, kind = KIND_ZERO;
+    BitWriter w = { .b = &ct->enc };
+    uint8_t tag;
+
+    for (i = 0; i < n; i++) {
+        const uint8_t *p = ct->rows.data + ct->offsets[ct->members[i]] + skip;
+        uint64_t v = get_word(p, g->size, col);
+        uint64_t d = v - prev;
+
+        ct->vals[i] = v;
+        ct->res[MODE_XOR][i] = v ^ prev;
+        ct->res[MODE_DELTA][i] = zigzag(d);
+        ct->res[MODE_DOD][i] = zigzag(d - pd);
+        prev = v;
+        pd = d;
+    }
+    for (mode = 0; mode < NMODES; mode++) {
+        int mw, mk;
+        size_t size = encoded_size(ct->res[mode], n, &mw, &mk);
+
+        if (size < bestsize) {
+            best = mode;
+            bestsize = size;
+            width = mw;
+            kind = mk;
+        }
+    }
+
+    tag = best | kind << 2;
+    buf_put(&ct->enc, &tag, 1);
+    if (kind != KIND_ZERO) {
+        const uint64_t *r = ct->res[best];
+        uint8_t wb = width;
+
+        buf_put(&ct->enc, &wb, 1);
+        if (kind == KIND_SPARSE) {
+            for (i = 0; i < n; i++) {
+                put_bits(&w, r[i] != 0, 1);
+            }
+            flush_bits(&w);
+        }
+        for (i = 0; i < n; i++) {
+            if (kind == KIND_DENSE || r[i]) {
+                put_bits(&w, r[i], width);
+            }
+        }
+        flush_bits(&w);
+    }
+    g->prev[col] = prev;
+    g->prevdelta[col] = pd;
+}
+
+static bool decode_column(ColTrace *ct, ColGroup *g, size_t col, size_t n,
+                          size_t skip, BitReader *r)
+{
+    uint64_t prev = g->prev[col], pd = g->prevdelta[col];
+    int tag, mode, kind, width = 0;
+    size_t i;
+
+    if (r->p == r->end) {
+        return false;
+    }
+    tag = *r->p++;
+    mode = tag & 3;
+    kind = tag >> 2;
+    if (mode >= NMODES || kind > KIND_SPARSE) {
+        return false;
+    }
+    if (kind != KIND_ZERO) {
+        if (r->p == r->end) {
+            return false;
+        }
+        width = *r->p++;
+        if (width < 1 || width > 64) {
+            return false;
+        }
+    }
+    r->acc = 0;
+    r->n = 0;
+    if (kind == KIND_SPARSE) {
+        for (i = 0; i < n; i++) {
+            ct->vals[i] = get_bits(r, 1);
+        }
+        r->acc = 0;
+        r->n = 0;
+    }
+    for (i = 0; i < n; i++) {
+        uint64_t res = 0, v;
+
+        if (kind == KIND_DENSE || (kind == KIND_SPARSE && ct->vals[i])) {
+            res = get_bits(r, width);
+        }
+        switch (mode) {
+        case MODE_XOR:
+            v = prev ^ res;
+            break;
+        case MODE_DELTA:
+            v = prev + unzigzag(res);
+            break;
+        default:
+            v = prev + pd + unzigzag(res);
+            break;
+        }
+        pd = v - prev;
+        prev = v;
+        put_word(ct->rows.data + ct->offsets[ct->members[i]] + skip,
+                 g->size, col, v);
+    }
+    r->acc = 0;
+    r->n = 0;
+    g->prev[col] = prev;
+    g->prevdelta[col] = pd;
+    return !r->overrun;
+}
+
+/*
+ * Calls fn for the header columns of all the block's records and then
+ * for each payload size's columns, in the order described above.
+ * Returns false if fn does, or if there are too many payload sizes.
+ */
+static bool for_each_group(ColTrace *ct,
+                           bool (*fn)(ColTrace *, ColGroup *, size_t,
+                                      size_t, void *),
+                           void *opaque)
+{
+    uint32_t seen[COL_MAXGROUPS];
+    int nseen = 0, k;
+    size_t i, j, n;
+
+    for (i = 0; i < ct->nrecords; i++) {
+        ct->members[i] = i;
+    }
+    if (!fn(ct, &ct->header, ct->nrecords, 0, opaque)) {
+        return false;
+    }
+
+    for (i = 0; i < ct->nrecords; i++) {
+        uint32_t size = record_size(ct, i);
+        ColGroup *g;
+
+        if (size == 0) {
+            continue;
+        }
+        for (k = 0; k < nseen && seen[k] != size; k++) {
+            /* nothing */
+        }
+        if (k < nseen) {
+            continue;
+        }
+        if (nseen == COL_MAXGROUPS) {
+            return false;
+        }
+        seen[nseen++] = size;
+        g = find_group(ct, size);
+        if (!g) {
+            return false;
+        }
+        n = 0;
+        for (j = i; j < ct->nrecords; j++) {
+            if (record_size(ct, j) == size) {
+                ct->members[n++] = j;
+            }
+        }
+        if (!fn(ct, g, n, sizeof(trace_header_t), opaque)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool encode_group(ColTrace *ct, ColGroup *g, size_t n, size_t skip,
+                         void *opaque)
+{
+    size_t col;
+
+    for (col = 0; col < g->ncols; col++) {
+        encode_column(ct, g, col, n, skip);
+    }
+    return true;
+}
+
+static bool decode_group(ColTrace *ct, ColGroup *g, size_t n, size_t skip,
+                         void *opaque)
+{
+    BitReader *r = opaque;
+    size_t hsize = sizeof(trace_header_t);
+    size_t col, i;
+
+    if (skip == 0) {
+        /* The headers give the record sizes, and so the layout. */
+        for (col = 0; col < g->ncols; col++) {
+            if (!decode_column(ct, g, col, n, 0, r)) {
+                return false;
+            }
+        }
+        /*
+         * Now that the sizes are known, spread the headers out to
+         * make room for the payloads.
+         */
+        for (i = 0; i < n; i++) {
+            ct->vals[i] = record_size(ct, i);
+            if (ct->vals[i] > COL_MAXPAYLOAD) {
+                return false;
+            }
+        }
+        for (i = 0; i < n; i++) {
+            ct->offsets[i + 1] = ct->offsets[i] + hsize + ct->vals[i];
+        }
+        buf_reserve(&ct->rows, ct->offsets[n] - ct->rows.len);
+        ct->rows.len = ct->offsets[n];
+        for (i = n; i-- > 0; ) {
+            memmove(ct->rows.data + ct->offsets[i], ct->rows.data + i * hsize,
+                    hsize);
+        }
+        return true;
+    }
+    for (col = 0; col < g->ncols; col++) {
+        if (!decode_column(ct, g, col, n, skip, r)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+    uint8_t *p = data;
+
+    while (len) {
+        ssize_t n = read(fd, p, len);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static RisuResult flush_block(ColTrace *ct)
+{
+    uint32_t hdr[2];
+
+    if (ct->nrecords == 0) {
+        return RES_OK;
+    }
+    ct->enc.len = 0;
+    if (!for_each_group(ct, encode_group, NULL)) {
+        return RES_BAD_SIZE;
+    }
+    hdr[0] = ct->nrecords;
+    hdr[1] = ct->enc.len;
+    if (!write_all(ct->fd, hdr, sizeof(hdr)) ||
+        !write_all(ct->fd, ct->enc.data, ct->enc.len)) {
+        return RES_BAD_IO;
+    }
+
+    /* Keep any part of the next record. */
+    memmove(ct->rows.data, ct->rows.data + ct->offsets[ct->nrecords],
+            ct->rows.len - ct->offsets[ct->nrecords]);
+    ct->rows.len -= ct->offsets[ct->nrecords];
+    ct->nrecords = 0;
+    return RES_OK;
+}
+
+static RisuResult read_block(ColTrace *ct)
+{
+    uint32_t hdr[2];
+    BitReader r = { 0 };
+    size_t i;
+
+    if (!read_all(ct->fd, hdr, sizeof(hdr)) ||
+        hdr[0] == 0 || hdr[0] > COL_BLOCK) {
+        return RES_BAD_IO;
+    }
+    ct->enc.len = 0;
+    buf_reserve(&ct->enc, hdr[1]);
+    if (!read_all(ct->fd, ct->enc.data, hdr[1])) {
+        return RES_BAD_IO;
+    }
+    r.p = ct->enc.data;
+    r.end = ct->enc.data + hdr[1];
+
+    /* Room for the headers; decode_group() sizes it for the rest. */
+    ct->nrecords = hdr[0];
+    ct->rows.len = 0;
+    buf_reserve(&ct->rows, ct->nrecords * sizeof(trace_header_t));
+    for (i = 0; i <= ct->nrecords; i++) {
+        ct->offsets[i] = i * sizeof(trace_header_t);
+    }
+    ct->rows.len = ct->offsets[ct->nrecords];
+    if (!for_each_group(ct, decode_group, &r)) {
+        return RES_BAD_IO;
+    }
+    ct->pos = 0;
+    return RES_OK;
+}
+
+bool coltrace_detect(int fd)
+{
+    uint32_t magic;
+
+    return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) &&
+           magic == COL_MAGIC;
+}
+
+ColTrace *coltrace_new(int fd, bool writing)
+{
+    ColTrace *ct = calloc(1, sizeof(*ct));
+    uint32_t hdr[2] = { COL_MAGIC, COL_VERSION };
+    int i;
+
+    ct->fd = fd;
+    ct->writing = writing;
+    group_init(&ct->header, sizeof(trace_header_t));
+    ct->vals = calloc(COL_BLOCK, sizeof(uint64_t));
+    for (i = 0; i < NMODES; i++) {
+        ct->res[i] = calloc(COL_BLOCK, sizeof(uint64_t));
+    }
+    ct->members = calloc(COL_BLOCK, sizeof(size_t));
+
+    if (writing ? !write_all(fd, hdr, sizeof(hdr))
+                : !read_all(fd, hdr, sizeof(hdr)) ||
+                  hdr[0] != COL_MAGIC || hdr[1] != COL_VERSION) {
+        coltrace_close(ct);
+        return NULL;
+    }
+    return ct;
+}
+
+RisuResult coltrace_write(ColTrace *ct, const void *data, size_t len)
+{
+    buf_put(&ct->rows, data, len);
+
+    /* Note each record as it is completed. */
+    for (;;) {
+        size_t start = ct->offsets[ct->nrecords];
+        size_t size;
+
+        if (ct->rows.len - start < sizeof(trace_header_t)) {
+            return RES_OK;
+        }
+        size = record_size(ct, ct->nrecords);
+        if (size > COL_MAXPAYLOAD) {
+            return RES_BAD_SIZE;
+        }
+        if (ct->rows.len - start < sizeof(trace_header_t) + size) {
+            return RES_OK;
+        }
+        ct->offsets[++ct->nrecords] = start + sizeof(trace_header_t) + size;
+        if (ct->nrecords == COL_BLOCK) {
+            RisuResult res = flush_block(ct);
+
+            if (res != RES_OK) {
+                return res;
+            }
+        }
+    }
+}
+
+RisuResult coltrace_read(ColTrace *ct, void *data, size_t len)
+{
+    uint8_t *p = data;
+
+    while (len) {
+        size_t n;
+
+        if (ct->pos == ct->rows.len) {
+            RisuResult res = read_block(ct);
+
+            if (res != RES_OK) {
+                return res;
+            }
+        }
+        n = ct->rows.len - ct->pos;
+        n = n < len ? n : len;
+        memcpy(p, ct->rows.data + ct->pos, n);
+        ct->pos += n;
+        p += n;
+        len -= n;
+    }
+    return RES_OK;
+}
+
+RisuResult coltrace_close(ColTrace *ct)
+{
+    RisuResult res = RES_OK;
+    int i;
+
+    if (ct->writing) {
+        res = flush_block(ct);
+    }
+    free(ct->header.prev);
+    free(ct->header.prevdelta);
+    for (i = 0; i < ct->ngroups; i++) {
+        free(ct->groups[i].prev);
+        free(ct->groups[i].prevdelta);
+    }
+    for (i = 0; i < NMODES; i++) {
+        free(ct->res[i]);
+    }
+    free(ct->vals);
+    free(ct->members);
+    free(ct->rows.data);
+    free(ct->enc.data);
+    free(ct);
+    return res;
+}
@@ -15,9 +15,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
@@ -26,13 +29,8 @@
 int apprentice_connect(const char *hostname, int port)
 {
     /* We are the client end of the TCP connection */
-    int sock;
+    int sock, tries;
     struct sockaddr_in sa;
-    sock = socket(PF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        exit(EXIT_FAILURE);
-    }
     struct hostent *hostinfo;
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
@@ -42,14 +40,47 @@ int apprentice_connect(const char *hostname, int port)
         exit(EXIT_FAILURE);
     }
     sa.sin_addr = *(struct in_addr *) hostinfo->h_addr;
-    if (connect(sock, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
-        perror("connect");
+
+    /*
+     * If the master isn't listening yet, retry for a few seconds, so
+     * that both ends can be started at once (as in peer mode).
+     */
+    for (tries = 0; ; tries++) {
+        sock = socket(PF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        if (connect(sock, (struct sockaddr *) &sa, sizeof(sa)) == 0) {
+            return sock;
+        }
+        if (errno != ECONNREFUSED || tries == 100) {
+            int refused = errno == ECONNREFUSED;
+
+            perror("connect");
+            exit(refused ? EXIT_NO_MASTER : EXIT_FAILURE);
+        }
+        close(sock);
+        usleep(100000);
+    }
+}
+
+static int accept_one(int sock)
+{
+    struct sockaddr_storage csa;
+    socklen_t csasz = sizeof(csa);
+    int nsock = accept(sock, (struct sockaddr *) &csa, &csasz);
+
+    if (nsock < 0) {
+        perror("accept");
         exit(EXIT_FAILURE);
     }
-    return sock;
+    /* We're done with the server socket now */
+    close(sock);
+    return nsock;
 }
 
-int master_connect(int port)
+int master_listen(int port)
 {
     int sock;
     struct sockaddr_in sa;
@@ -72,46 +103,219 @@ int master_connect(int port)
         perror("bind");
         exit(EXIT_FAILURE);
     }
-    if (listen(sock, 1) < 0) {
+    if (listen(sock, SOMAXCONN) < 0) {
         perror("listen");
         exit(EXIT_FAILURE);
     }
+    return sock;
+}
+
+int master_connect(int port)
+{
+    int sock = master_listen(port);
+
     /* Just block until we get a connection */
     fprintf(stderr, "master: waiting for connection on port %d...\n",
             port);
-    struct sockaddr_in csa;
-    socklen_t csasz = sizeof(csa);
-    int nsock = accept(sock, (struct sockaddr *) &csa, &csasz);
-    if (nsock < 0) {
-        perror("accept");
+    return accept_one(sock);
+}
+
+/*
+ * Rendezvous: rather than on a fixed port, the master listens on an
+ * ephemeral TCP port or an autobound abstract Unix socket and
+ * publishes the address, as "tcp:PORT" or "unix:@NAME", in a file
+ * (or on stdout for "-") from which the apprentice picks it up. Any
+ * number of pairs can then run on one host at once.
+ */
+static void publish_address(const char *file, const char *addr)
+{
+    char *tmp;
+    FILE *f;
+
+    if (strcmp(file, "-") == 0) {
+        printf("%s\n", addr);
+        fflush(stdout);
+        return;
+    }
+    /* Write it under another name first, so it appears complete. */
+    tmp = malloc(strlen(file) + 5);
+    sprintf(tmp, "%s.tmp", file);
+    f = fopen(tmp, "w");
+    if (!f || fprintf(f, "%s\n", addr) < 0 || fclose(f) != 0 ||
+        rename(tmp, file) != 0) {
+        perror(file);
         exit(EXIT_FAILURE);
     }
-    /* We're done with the server socket now */
-    close(sock);
-    return nsock;
+    free(tmp);
+}
+
+int master_rendezvous(const char *file, bool use_unix)
+{
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    } addr;
+    socklen_t len;
+    char name[64];
+    int sock;
+
+    memset(&addr, 0, sizeof(addr));
+    if (use_unix) {
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        addr.un.sun_family = AF_UNIX;
+        /* Binding just the family autobinds an abstract name. */
+        len = sizeof(sa_family_t);
+    } else {
+        sock = socket(PF_INET, SOCK_STREAM, 0);
+        addr.in.sin_family = AF_INET;
+        addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
+        /* Port 0 picks an unused one. */
+        len = sizeof(addr.in);
+    }
+    if (sock < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (bind(sock, &addr.sa, len) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(sock, 1) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    len = sizeof(addr);
+    if (getsockname(sock, &addr.sa, &len) < 0) {
+        perror("getsockname");
+        exit(EXIT_FAILURE);
+    }
+    if (use_unix) {
+        /* The name follows a NUL, and is not terminated. */
+        snprintf(name, sizeof(name), "unix:@%.*s",
+                 (int)(len - offsetof(struct sockaddr_un, sun_path) - 1),
+                 addr.un.sun_path + 1);
+    } else {
+        snprintf(name, sizeof(name), "tcp:%d", ntohs(addr.in.sin_port));
+    }
+    publish_address(file, name);
+    fprintf(stderr, "master: waiting for connection on %s...\n", name);
+    return accept_one(sock);
+}
+
+int apprentice_rendezvous(const char *file, const char *hostname)
+{
+    FILE *f = NULL;
+    char addr[64];
+    int port, tries;
+
+    if (strcmp(file, "-") == 0) {
+        f = stdin;
+    } else {
+        /* The master may not have published it yet. */
+        for (tries = 0; !(f = fopen(file, "r")); tries++) {
+            if (errno != ENOENT || tries == 100) {
+                int missing = errno == ENOENT;
+
+                perror(file);
+                exit(missing ? EXIT_NO_MASTER : EXIT_FAILURE);
+            }
+            usleep(100000);
+        }
+    }
+    if (!fgets(addr, sizeof(addr), f)) {
+        fprintf(stderr, "%s: no rendezvous address\n", file);
+        exit(EXIT_FAILURE);
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    addr[strcspn(addr, "\n")] = 0;
+
+    if (sscanf(addr, "tcp:%d", &port) == 1) {
+        return apprentice_connect(hostname, port);
+    }
+    if (strncmp(addr, "unix:@", 6) == 0) {
+        struct sockaddr_un un;
+        size_t namelen = strlen(addr + 6);
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (sock < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        if (namelen + 1 > sizeof(un.sun_path)) {
+            fprintf(stderr, "%s: address too long\n", file);
+            exit(EXIT_FAILURE);
+        }
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        memcpy(un.sun_path + 1, addr + 6, namelen);
+        if (connect(sock, (struct sockaddr *) &un,
+                    offsetof(struct sockaddr_un, sun_path) + 1 + namelen) < 0) {
+            perror("connect");
+            exit(EXIT_FAILURE);
+        }
+        return sock;
+    }
+    fprintf(stderr, "%s: bad rendezvous address '%s'\n", file, addr);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Run cmd (through the shell) with " --fd=N" appended, where N is one
+ * end of a socketpair, and return the other end. With the apprentice's
+ * risu command line as cmd, no address is needed at all.
+ */
+int spawn_with_socketpair(const char *cmd, pid_t *pid)
+{
+    int sv[2];
+    char *full;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+    full = malloc(strlen(cmd) + 32);
+    sprintf(full, "%s --fd=%d", cmd, sv[1]);
+
+    *pid = fork();
+    if (*pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (*pid == 0) {
+        close(sv[0]);
+        execl("/bin/sh", "sh", "-c", full, (char *)NULL);
+        perror("/bin/sh");
+        _exit(127);
+    }
+    free(full);
+    close(sv[1]);
+    return sv[0];
 }
 
 /* Utility functions which are just wrappers around read and writev
  * to catch errors and retry on short reads/writes.
  */
-static void recv_bytes(int sock, void *pkt, int pktlen)
+static bool recv_bytes(int sock, void *pkt, int pktlen)
 {
     char *p = pkt;
     while (pktlen) {
         int i = read(sock, p, pktlen);
         if (i <= 0) {
-            if (errno == EINTR) {
+            if (i < 0 && errno == EINTR) {
                 continue;
             }
-            perror("read failed");
-            exit(EXIT_FAILURE);
+            return false;
         }
         pktlen -= i;
         p += i;
     }
+    return true;
 }
 
-static void recv_and_discard_bytes(int sock, int pktlen)
+static bool recv_and_discard_bytes(int sock, int pktlen)
 {
     /* Read and discard bytes */
     char dumpbuf[64];
@@ -123,14 +327,14 @@ static void recv_and_discard_bytes(int sock, int pktlen)
         }
         i = read(sock, dumpbuf, len);
         if (i <= 0) {
-            if (errno == EINTR) {
+            if (i < 0 && errno == EINTR) {
                 continue;
             }
-            perror("read failed");
-            exit(EXIT_FAILURE);
+            return false;
         }
         pktlen -= i;
     }
+    return true;
 }
 
 ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
@@ -169,6 +373,21 @@ ssize_t safe_writev(int fd, struct iovec *iov_in, int iovcnt)
  * block of data.
  */
 RisuResult send_data_pkt(int sock, void *pkt, int pktlen)
+{
+    RisuResult r = try_send_data_pkt(sock, pkt, pktlen);
+
+    if (r == RES_BAD_IO) {
+        perror("send_data_pkt");
+        exit(EXIT_FAILURE);
+    }
+    return r;
+}
+
+/*
+ * As send_data_pkt, but return RES_BAD_IO if the connection fails,
+ * for a server which must outlive its clients.
+ */
+RisuResult try_send_data_pkt(int sock, void *pkt, int pktlen)
 {
     unsigned char resp;
     /* First we send the packet length as a network-order 32 bit value.
@@ -185,31 +404,68 @@ RisuResult send_data_pkt(int sock, void *pkt, int pktlen)
     iov[1].iov_len = pktlen;
 
     if (safe_writev(sock, iov, 2) == -1) {
-        perror("writev failed");
-        exit(EXIT_FAILURE);
+        return RES_BAD_IO;
     }
 
-    if (read(sock, &resp, 1) != 1) {
-        perror("read failed");
-        exit(EXIT_FAILURE);
+    for (;;) {
+        ssize_t i = read(sock, &resp, 1);
+
+        if (i == 1) {
+            return resp;
+        }
+        if (i == 0 || errno != EINTR) {
+            return RES_BAD_IO;
+        }
     }
-    return resp;
 }
 
-RisuResult recv_data_pkt(int sock, void *pkt, int pktlen)
+/*
+ * Receive a packet of up to maxlen bytes into pkt, setting *pktlen.
+ * Returns RES_BAD_SIZE (having read and dropped the packet) if it is
+ * longer, or RES_BAD_IO if the connection fails.
+ */
+static RisuResult recv_var_pkt(int sock, void *pkt, int maxlen, int *pktlen)
 {
     uint32_t net_pktlen;
-    recv_bytes(sock, &net_pktlen, sizeof(net_pktlen));
-    net_pktlen = ntohl(net_pktlen);
-    if (pktlen != net_pktlen) {
-        /* Mismatch. Read the data anyway so we can send
+
+    if (!recv_bytes(sock, &net_pktlen, sizeof(net_pktlen))) {
+        return RES_BAD_IO;
+    }
+    *pktlen = ntohl(net_pktlen);
+    if (*pktlen > maxlen) {
+        return recv_and_discard_bytes(sock, *pktlen) ? RES_BAD_SIZE
+                                                     : RES_BAD_IO;
+    }
+    return recv_bytes(sock, pkt, *pktlen) ? RES_OK : RES_BAD_IO;
+}
+
+/* As recv_data_pkt, but return RES_BAD_IO if the connection fails. */
+RisuResult try_recv_data_pkt(int sock, void *pkt, int pktlen)
+{
+    RisuResult r;
+    int len;
+
+    r = recv_var_pkt(sock, pkt, pktlen, &len);
+    if (r == RES_OK && len != pktlen) {
+        r = RES_BAD_SIZE;
+    }
+    return r;
+}
+
+RisuResult recv_data_pkt(int sock, void *pkt, int pktlen)
+{
+    switch (try_recv_data_pkt(sock, pkt, pktlen)) {
+    case RES_OK:
+        return RES_OK;
+    case RES_BAD_SIZE:
+        /* Mismatch. We read the data anyway so we can send
          * a response back.
          */
-        recv_and_discard_bytes(sock, net_pktlen);
         return RES_BAD_IO;
+    default:
+        perror("read failed");
+        exit(EXIT_FAILURE);
     }
-    recv_bytes(sock, pkt, pktlen);
-    return RES_OK;
 }
 
 void send_response_byte(int sock, int resp)
@@ -220,3 +476,194 @@ void send_response_byte(int sock, int resp)
         exit(EXIT_FAILURE);
     }
 }
+
+static bool try_send_response_byte(int sock, int resp)
+{
+    unsigned char r = resp;
+
+    while (write(sock, &r, 1) != 1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * RISU_FEAT_DELTA: a payload is sent as its XOR with the previous
+ * payload of the same kind (prev, which both ends keep), coded as
+ * pairs of 16-bit counts, of zero bytes and then of literal bytes,
+ * each pair followed by its literals. From one checkpoint to the next
+ * most registers don't change, so most of the XOR is zero.
+ */
+RisuResult send_delta_pkt(int sock, const void *pkt, void *prev, int pktlen,
+                          void *buf)
+{
+    const uint8_t *p = pkt;
+    uint8_t *x = prev, *out = buf;
+    int i, j, k, n = 0;
+
+    for (i = 0; i < pktlen; i++) {
+        x[i] ^= p[i];
+    }
+    for (i = 0; i < pktlen; i = k) {
+        uint16_t count[2];
+
+        for (j = i; j < pktlen && j - i < UINT16_MAX && !x[j]; j++) {
+            continue;
+        }
+        /* Short runs of zeros are cheaper kept in the literals. */
+        for (k = j; k < pktlen && k - j < UINT16_MAX; k++) {
+            if (!x[k] && k + 4 <= pktlen &&
+                !(x[k + 1] | x[k + 2] | x[k + 3])) {
+                break;
+            }
+        }
+        count[0] = j - i;
+        count[1] = k - j;
+        memcpy(out + n, count, sizeof(count));
+        memcpy(out + n + sizeof(count), x + j, k - j);
+        n += sizeof(count) + k - j;
+    }
+    memcpy(prev, pkt, pktlen);
+    return send_data_pkt(sock, buf, n);
+}
+
+RisuResult recv_delta_pkt(int sock, void *pkt, void *prev, int pktlen,
+                          void *buf)
+{
+    uint8_t *p = pkt, *x = prev, *in = buf;
+    int i = 0, n = 0, len, end;
+
+    switch (recv_var_pkt(sock, buf, DELTA_BUF_LEN(pktlen), &len)) {
+    case RES_OK:
+        break;
+    case RES_BAD_SIZE:
+        return RES_BAD_IO;
+    default:
+        perror("read failed");
+        exit(EXIT_FAILURE);
+    }
+    while (n + 4 <= len) {
+        uint16_t count[2];
+
+        memcpy(count, in + n, sizeof(count));
+        n += sizeof(count);
+        if (i + count[0] + count[1] > pktlen || n + count[1] > len) {
+            return RES_BAD_IO;
+        }
+        memcpy(p + i, x + i, count[0]);
+        i += count[0];
+        for (end = i + count[1]; i < end; i++, n++) {
+            p[i] = x[i] ^ in[n];
+        }
+    }
+    if (i != pktlen || n != len) {
+        return RES_BAD_IO;
+    }
+    memcpy(prev, pkt, pktlen);
+    return RES_OK;
+}
+
+static bool hello_matches(const risu_hello_t *mine, risu_hello_t *theirs,
+                          const char *who)
+{
+    bool ok = true;
+
+    if (theirs->magic != RISU_HELLO_MAGIC) {
+        fprintf(stderr, "handshake: the %s did not send one\n", who);
+        return false;
+    }
+    if (theirs->version != mine->version) {
+        fprintf(stderr, "handshake: the %s speaks protocol version %u, "
+                "we speak %u\n", who, theirs->version, mine->version);
+        return false;
+    }
+    theirs->arch[sizeof(theirs->arch) - 1] = 0;
+    theirs->config[sizeof(theirs->config) - 1] = 0;
+
+    /* Fields either end leaves empty are not known to it. */
+    if (*mine->arch && *theirs->arch) {
+        if (strcmp(mine->arch, theirs->arch) != 0) {
+            fprintf(stderr, "handshake: the %s is for %s, we are for %s\n",
+                    who, theirs->arch, mine->arch);
+            ok = false;
+        } else if (strcmp(mine->config, theirs->config) != 0) {
+            fprintf(stderr, "handshake: the %s has options '%s', "
+                    "we have '%s'\n", who, theirs->config, mine->config);
+            ok = false;
+        }
+    }
+    if (mine->reginfo_size && theirs->reginfo_size &&
+        mine->reginfo_size != theirs->reginfo_size) {
+        fprintf(stderr, "handshake: the %s's reginfo is %u bytes, "
+                "ours is %u\n", who, theirs->reginfo_size,
+                mine->reginfo_size);
+        ok = false;
+    }
+    if (mine->memblock_size != theirs->memblock_size) {
+        fprintf(stderr, "handshake: the %s's memory block is %u bytes, "
+                "ours is %u\n", who, theirs->memblock_size,
+                mine->memblock_size);
+        ok = false;
+    }
+    if (mine->image_hash && theirs->image_hash &&
+        mine->image_hash != theirs->image_hash) {
+        fprintf(stderr, "handshake: the %s is running a different image\n",
+                who);
+        ok = false;
+    }
+    return ok;
+}
+
+/*
+ * The handshake before the first record: the master sends its hello
+ * and the apprentice answers with its own, each end checking the
+ * other's against its own. Either end answers RES_END to a hello it
+ * won't work with, having said why. On success *features is what
+ * both ends support.
+ */
+RisuResult risu_handshake(int sock, bool master, const risu_hello_t *mine,
+                          uint32_t *features)
+{
+    const char *who = master ? "apprentice" : "master";
+    risu_hello_t theirs;
+    RisuResult r;
+    bool ok;
+
+    if (master) {
+        r = try_send_data_pkt(sock, (void *)mine, sizeof(*mine));
+        if (r != RES_OK) {
+            fprintf(stderr, "handshake: the apprentice %s\n",
+                    r == RES_BAD_IO ? "went away"
+                    : "refused ours (or is an older risu)");
+            return RES_BAD_HELLO;
+        }
+    }
+
+    r = try_recv_data_pkt(sock, &theirs, sizeof(theirs));
+    if (r == RES_BAD_IO) {
+        fprintf(stderr, "handshake: the %s went away\n", who);
+        return RES_BAD_HELLO;
+    }
+    if (r != RES_OK) {
+        fprintf(stderr, "handshake: the %s did not send one "
+                "(an older risu?)\n", who);
+        ok = false;
+    } else {
+        ok = hello_matches(mine, &theirs, who);
+    }
+    if (!try_send_response_byte(sock, ok ? RES_OK : RES_END) || !ok) {
+        return RES_BAD_HELLO;
+    }
+
+    if (!master) {
+        r = try_send_data_pkt(sock, (void *)mine, sizeof(*mine));
+        if (r != RES_OK) {
+            fprintf(stderr, "handshake: the master refused ours\n");
+            return RES_BAD_HELLO;
+        }
+    }
+    *features = mine->features & theirs.features;
+    return RES_OK;
+}
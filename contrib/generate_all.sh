@@ -16,12 +16,13 @@
 
 set -e
 
-USAGE="Usage: `basename $0` [-h] [-n x] <risufile> <target dir> -- [risugen args]"
+USAGE="Usage: `basename $0` [-h] [-n x] [-j jobs] <risufile> <target dir> -- [risugen args]"
 SPLIT=4
+JOBS=$(nproc 2>/dev/null || echo 1)
 RISUGEN=$(CDPATH= cd -- "$(dirname -- "$0")/.." && pwd -P)/risugen
 
 # Parse command line options.
-while getopts hn: OPT; do
+while getopts hn:j: OPT; do
     case "$OPT" in
         h)
             echo $USAGE
@@ -30,6 +31,9 @@ while getopts hn: OPT; do
         n)
             SPLIT=$OPTARG
             ;;
+        j)
+            JOBS=$OPTARG
+            ;;
         \?)
             # getopts issues an error message
             echo $USAGE >&2
@@ -78,25 +82,11 @@ fi
 
 mkdir -p ${TARGET_DIR}
 
-ALL_INSNS=$(cat ${RISU_FILE} | ag "^\w" | cut -f 1 -d " " | sort)
-COUNT=$(cat ${RISU_FILE=} | ag "^\w" | cut -f 1 -d " " | wc -l)
-set -- $ALL_INSNS
-
-GROUP=$((COUNT / ${SPLIT}))
+# Share one parsed copy of the pattern file between runs
+CACHE_DIR="${TARGET_DIR}/.risugen-cache"
 
-while test $# -gt 0 ; do
-    INSN_PATTERNS=""
-    I_FILE="${TARGET_DIR}/insn_"
-    for i in `seq 1 ${SPLIT}`; do
-        I=$1
-        if test -n "${I}"; then
-            shift
-            INSN_PATTERNS="${INSN_PATTERNS} --pattern ${I}"
-            I_FILE="${I_FILE}${I}_"
-        fi
-    done
-    I_FILE="${I_FILE}_INC.risu.bin"
-    CMD="${RISUGEN} ${RISUGEN_ARGS} ${INSN_PATTERNS} ${RISU_FILE} ${I_FILE}"
-    echo "Running: $CMD"
-    $CMD
-done
+# risugen splits the patterns into groups of ${SPLIT} itself and
+# writes every output from the one process.
+CMD="${RISUGEN} --cache-dir ${CACHE_DIR} --split ${SPLIT} --jobs ${JOBS} ${RISUGEN_ARGS} ${RISU_FILE} ${TARGET_DIR}"
+echo "Running: $CMD"
+$CMD
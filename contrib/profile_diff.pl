@@ -0,0 +1,54 @@
+#!/usr/bin/perl -w
+#
+# Compare two profiles written by risu --profile, for instance from
+# two builds of the model under test, and list the patterns whose
+# mean time changed most.
+#
+# Usage:
+#   qemu-old ./risu --profile=test.bin.map test.bin -t test.trace 2> old.prof
+#   qemu-new ./risu --profile=test.bin.map test.bin -t test.trace 2> new.prof
+#   ./profile_diff.pl old.prof new.prof
+#
+# Lines which are not profile rows (risu's other messages) are ignored.
+# The ratio column is new mean / old mean; patterns only present in
+# one of the profiles are listed at the end.
+
+use strict;
+
+sub read_profile($)
+{
+    my ($fname) = @_;
+    my %prof;
+    open(my $fh, "<", $fname) or die "can't open $fname: $!";
+    while (<$fh>) {
+        my ($count, $mean, $p99, $total, $name) =
+            /^\s+(\d+)\s+(\d+)\s+(\d+)\s+(\d+)  (.*)$/ or next;
+        $prof{$name} = { count => $count, mean => $mean, p99 => $p99 };
+    }
+    close($fh);
+    return \%prof;
+}
+
+if (@ARGV != 2) {
+    print STDERR "Usage: $0 old-profile new-profile\n";
+    exit(1);
+}
+
+my $old = read_profile($ARGV[0]);
+my $new = read_profile($ARGV[1]);
+my @common = grep { exists $new->{$_} && $old->{$_}{mean} } keys %$old;
+my %ratio = map { $_ => $new->{$_}{mean} / $old->{$_}{mean} } @common;
+
+printf "# %8s %12s %12s %12s %12s  %s\n",
+    "ratio", "old_mean", "new_mean", "old_p99", "new_p99", "pattern";
+for my $name (sort { $ratio{$b} <=> $ratio{$a} || $a cmp $b } @common) {
+    printf "  %8.3f %12d %12d %12d %12d  %s\n", $ratio{$name},
+        $old->{$name}{mean}, $new->{$name}{mean},
+        $old->{$name}{p99}, $new->{$name}{p99}, $name;
+}
+for my $name (sort keys %$old) {
+    print "  only in $ARGV[0]: $name\n" if !exists $new->{$name};
+}
+for my $name (sort keys %$new) {
+    print "  only in $ARGV[1]: $name\n" if !exists $old->{$name};
+}
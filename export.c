@@ -0,0 +1,669 @@
+/******************************************************************************
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * Structured trace export for --export.
+ *
+ * Each record of the trace is written to stdout as a JSON object on a
+ * line of its own (jsonl), as a CSV row (csv), or as a binary record
+ * after a header naming the fields (bin). Register values are given
+ * in hex, as the integer their bytes make in host byte order, and
+ * memory blocks as their bytes in memory order.
+ *
+ * The main thread reads the trace into batches, which worker threads
+ * format into buffers of their own by hand rather than through stdio.
+ * The main thread writes the buffers out in trace order as they are
+ * finished, one write() each, so an export is limited by I/O rather
+ * than by formatting.
+ *
+ * The columns are the registers of the first register record. A
+ * record with a different register set (after an SVE vector length
+ * change, say) keeps its own registers in jsonl but has none in csv
+ * and bin.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "risu.h"
+
+#define BATCH_RECORDS   1024
+#define MAX_WORKERS     16
+#define QUEUE_LEN       (2 * MAX_WORKERS)
+#define MAX_REGS        4096
+#define MAX_FILTER      256
+
+#define EXPORT_MAGIC    (('R' << 24) | ('X' << 16) | ('P' << 8) | 'B')
+#define EXPORT_VERSION  1
+
+enum { FMT_JSONL, FMT_CSV, FMT_BIN };
+
+typedef struct {
+    char *name;
+    RisuRegClass cls;
+    size_t size;
+    bool selected;
+} Field;
+
+/* The binary form of each record, followed by len bytes of payload. */
+typedef struct {
+    uint64_t index;
+    uint64_t pc;
+    int32_t op;
+    uint32_t len;
+} export_record_t;
+
+typedef struct {
+    uint64_t index;
+    uint64_t pc;
+    int32_t op;
+    uint32_t size;              /* of the payload kept in data */
+    size_t offset;
+} Rec;
+
+typedef struct {
+    Rec *recs;
+    size_t n, cap;
+    uint8_t *data;
+    size_t len, datacap;
+    char *out;
+    size_t outlen, outcap;
+    bool done;
+} Batch;
+
+/* Where formatting of one register record has got to. */
+typedef struct {
+    Batch *b;
+    size_t n;                   /* registers visited */
+    bool other;                 /* not the layout of the columns */
+    bool first;                 /* no jsonl register written yet */
+} Visit;
+
+static int format = FMT_JSONL;
+static char *filter[MAX_FILTER];
+static int nfilter;
+static bool have_filter;
+static bool filter_mem = true;
+static bool have_pc_range;
+static uint64_t pc_start, pc_end;
+
+static Field *layout;
+static size_t nlayout;
+static bool have_layout;
+static bool header_written;
+static bool write_failed;
+static uint64_t nrecords;
+
+static char hexpair[256][2];
+
+static Batch *current;
+static pthread_t workers[MAX_WORKERS];
+static int nworkers;
+
+/*
+ * Batches in flight, in trace order: ring[head % QUEUE_LEN] is the
+ * oldest not yet written and ring[taken % QUEUE_LEN] the next for a
+ * worker to format.
+ */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+static Batch *ring[QUEUE_LEN];
+static uint64_t head, taken, submitted;
+static bool finishing;
+
+static void *xrealloc(void *p, size_t size)
+{
+    p = realloc(p, size);
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+/* Write to stdout, reporting the first failure. */
+static void output(const void *buf, size_t len)
+{
+    if (write_failed) {
+        return;
+    }
+    while (len) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("export: write");
+            write_failed = true;
+            return;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+}
+
+bool export_set_format(const char *name)
+{
+    if (!strcmp(name, "jsonl")) {
+        format = FMT_JSONL;
+    } else if (!strcmp(name, "csv")) {
+        format = FMT_CSV;
+    } else if (!strcmp(name, "bin")) {
+        format = FMT_BIN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void export_set_fields(const char *fields)
+{
+    char *list = strdup(fields);
+    char *tok, *save;
+
+    have_filter = true;
+    filter_mem = false;
+    for (tok = strtok_r(list, ",", &save); tok && nfilter < MAX_FILTER;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(tok, "mem")) {
+            filter_mem = true;
+        } else {
+            filter[nfilter++] = tok;
+        }
+    }
+}
+
+bool export_set_pc_range(const char *range)
+{
+    char *end;
+
+    pc_start = strtoull(range, &end, 0);
+    if (*end != '-') {
+        return false;
+    }
+    pc_end = strtoull(end + 1, &end, 0);
+    if (*end || pc_end <= pc_start) {
+        return false;
+    }
+    have_pc_range = true;
+    return true;
+}
+
+static bool name_selected(const char *name)
+{
+    int i;
+
+    if (!have_filter) {
+        return true;
+    }
+    for (i = 0; i < nfilter; i++) {
+        if (!strcmp(filter[i], name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Output buffer helpers; the caller reserves room first. */
+
+static void reserve(Batch *b, size_t n)
+{
+    if (b->outlen + n > b->outcap) {
+        b->outcap = (b->outlen + n) * 2;
+        b->out = xrealloc(b->out, b->outcap);
+    }
+}
+
+static void put_str(Batch *b, const char *s, size_t len)
+{
+    memcpy(b->out + b->outlen, s, len);
+    b->outlen += len;
+}
+
+#define PUT_LIT(b, s)   put_str(b, s, sizeof(s) - 1)
+
+static void put_dec(Batch *b, uint64_t v)
+{
+    char buf[20];
+    int i = sizeof(buf);
+
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    put_str(b, buf + i, sizeof(buf) - i);
+}
+
+/* The bytes at data as one hex number, most significant first. */
+static void put_hex_value(Batch *b, const uint8_t *data, size_t size)
+{
+    char *p = b->out + b->outlen;
+    size_t i;
+
+    *p++ = '0';
+    *p++ = 'x';
+    for (i = 0; i < size; i++) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        const char *h = hexpair[data[size - 1 - i]];
+#else
+        const char *h = hexpair[data[i]];
+#endif
+        *p++ = h[0];
+        *p++ = h[1];
+    }
+    b->outlen += 2 + 2 * size;
+}
+
+static void put_hex_bytes(Batch *b, const uint8_t *data, size_t size)
+{
+    char *p = b->out + b->outlen;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        *p++ = hexpair[data[i]][0];
+        *p++ = hexpair[data[i]][1];
+    }
+    b->outlen += 2 * size;
+}
+
+static void collect_layout(void *opaque, const char *name, RisuRegClass cls,
+                           const void *data, size_t size)
+{
+    if (nlayout < MAX_REGS) {
+        layout[nlayout].name = strdup(name);
+        layout[nlayout].cls = cls;
+        layout[nlayout].size = size;
+        layout[nlayout].selected = name_selected(name);
+        nlayout++;
+    }
+}
+
+static void visit_register(void *opaque, const char *name, RisuRegClass cls,
+                           const void *data, size_t size)
+{
+    Visit *v = opaque;
+    Batch *b = v->b;
+    size_t j = v->n++;
+    bool selected;
+
+    if (!v->other &&
+        (j >= nlayout || layout[j].size != size ||
+         strcmp(layout[j].name, name) != 0)) {
+        v->other = true;
+    }
+
+    switch (format) {
+    case FMT_JSONL:
+        selected = v->other ? name_selected(name) : layout[j].selected;
+        if (selected) {
+            reserve(b, strlen(name) + 2 * size + 8);
+            if (!v->first) {
+                PUT_LIT(b, ",");
+            }
+            v->first = false;
+            PUT_LIT(b, "\"");
+            put_str(b, name, strlen(name));
+            PUT_LIT(b, "\":\"");
+            put_hex_value(b, data, size);
+            PUT_LIT(b, "\"");
+        }
+        break;
+    case FMT_CSV:
+        if (!v->other && layout[j].selected) {
+            reserve(b, 2 * size + 3);
+            PUT_LIT(b, ",");
+            put_hex_value(b, data, size);
+        }
+        break;
+    case FMT_BIN:
+        if (!v->other && layout[j].selected) {
+            reserve(b, size);
+            put_str(b, data, size);
+        }
+        break;
+    }
+}
+
+static void format_record(Batch *b, const Rec *r)
+{
+    const uint8_t *payload = b->data + r->offset;
+    bool regs = r->op == OP_COMPARE || r->op == OP_TESTEND ||
+        r->op == OP_SIGILL;
+    Visit v = { .b = b, .first = true };
+    const char *op = op_name(r->op);
+    size_t start, j;
+
+    switch (format) {
+    case FMT_JSONL:
+        reserve(b, strlen(op) + 80);
+        PUT_LIT(b, "{\"n\":");
+        put_dec(b, r->index);
+        PUT_LIT(b, ",\"op\":\"");
+        put_str(b, op, strlen(op));
+        PUT_LIT(b, "\",\"pc\":\"");
+        put_hex_value(b, (const uint8_t *)&r->pc, sizeof(r->pc));
+        PUT_LIT(b, "\"");
+        if (regs) {
+            PUT_LIT(b, ",\"regs\":{");
+            reginfo_visit((struct reginfo *)payload, visit_register, &v);
+            reserve(b, 1);
+            PUT_LIT(b, "}");
+        } else if (r->size) {
+            reserve(b, 2 * r->size + 10);
+            PUT_LIT(b, ",\"mem\":\"");
+            put_hex_bytes(b, payload, r->size);
+            PUT_LIT(b, "\"");
+        }
+        reserve(b, 2);
+        PUT_LIT(b, "}\n");
+        break;
+
+    case FMT_CSV:
+        reserve(b, strlen(op) + 48);
+        put_dec(b, r->index);
+        PUT_LIT(b, ",");
+        put_str(b, op, strlen(op));
+        PUT_LIT(b, ",");
+        put_hex_value(b, (const uint8_t *)&r->pc, sizeof(r->pc));
+        start = b->outlen;
+        if (regs) {
+            reginfo_visit((struct reginfo *)payload, visit_register, &v);
+        }
+        if (!regs || v.other || v.n != nlayout) {
+            /* Blank register columns. */
+            b->outlen = start;
+            reserve(b, nlayout);
+            for (j = 0; j < nlayout; j++) {
+                if (layout[j].selected) {
+                    PUT_LIT(b, ",");
+                }
+            }
+        }
+        reserve(b, 1);
+        PUT_LIT(b, "\n");
+        break;
+
+    case FMT_BIN: {
+        export_record_t rec = {
+            .index = r->index, .pc = r->pc, .op = r->op, .len = r->size
+        };
+
+        reserve(b, sizeof(rec) + r->size);
+        start = b->outlen;
+        put_str(b, (const char *)&rec, sizeof(rec));
+        if (!regs) {
+            put_str(b, (const char *)payload, r->size);
+            break;
+        }
+        reginfo_visit((struct reginfo *)payload, visit_register, &v);
+        if (v.other || v.n != nlayout) {
+            b->outlen = start + sizeof(rec);
+        }
+        rec.len = b->outlen - start - sizeof(rec);
+        memcpy(b->out + start, &rec, sizeof(rec));
+        break;
+    }
+    }
+}
+
+static void *worker(void *opaque)
+{
+    for (;;) {
+        Batch *b;
+        size_t i;
+
+        pthread_mutex_lock(&ring_lock);
+        while (taken == submitted && !finishing) {
+            pthread_cond_wait(&ring_cond, &ring_lock);
+        }
+        if (taken == submitted) {
+            pthread_mutex_unlock(&ring_lock);
+            break;
+        }
+        b = ring[taken++ % QUEUE_LEN];
+        pthread_mutex_unlock(&ring_lock);
+
+        for (i = 0; i < b->n; i++) {
+            format_record(b, &b->recs[i]);
+        }
+
+        pthread_mutex_lock(&ring_lock);
+        b->done = true;
+        pthread_cond_broadcast(&ring_cond);
+        pthread_mutex_unlock(&ring_lock);
+    }
+    return NULL;
+}
+
+static void start_workers(void)
+{
+    static const char digits[] = "0123456789abcdef";
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        hexpair[i][0] = digits[i >> 4];
+        hexpair[i][1] = digits[i & 15];
+    }
+
+    nworkers = ncpus < 1 ? 1 : ncpus > MAX_WORKERS ? MAX_WORKERS : ncpus;
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i], NULL, worker, NULL)) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void write_header(void)
+{
+    Batch h = { 0 };
+    size_t j;
+
+    if (format == FMT_CSV) {
+        reserve(&h, 16);
+        PUT_LIT(&h, "n,op,pc");
+        for (j = 0; j < nlayout; j++) {
+            if (layout[j].selected) {
+                reserve(&h, strlen(layout[j].name) + 1);
+                PUT_LIT(&h, ",");
+                put_str(&h, layout[j].name, strlen(layout[j].name));
+            }
+        }
+        reserve(&h, 1);
+        PUT_LIT(&h, "\n");
+    } else if (format == FMT_BIN) {
+        /* magic, version, register count, memory block size */
+        uint32_t words[4] = {
+            EXPORT_MAGIC, EXPORT_VERSION, 0, filter_mem ? MEMBLOCKLEN : 0
+        };
+
+        for (j = 0; j < nlayout; j++) {
+            words[2] += layout[j].selected;
+        }
+        reserve(&h, sizeof(words));
+        put_str(&h, (const char *)words, sizeof(words));
+        /* Then for each register: u32 size, u8 class, u8 name length, name */
+        for (j = 0; j < nlayout; j++) {
+            if (layout[j].selected) {
+                uint32_t size = layout[j].size;
+                uint8_t cls = layout[j].cls;
+                uint8_t len = strlen(layout[j].name);
+
+                reserve(&h, 6 + len);
+                put_str(&h, (const char *)&size, 4);
+                put_str(&h, (const char *)&cls, 1);
+                put_str(&h, (const char *)&len, 1);
+                put_str(&h, layout[j].name, len);
+            }
+        }
+    }
+    output(h.out, h.outlen);
+    free(h.out);
+    header_written = true;
+}
+
+/* Wait for the oldest batch in flight to be formatted and write it. */
+static void write_oldest(void)
+{
+    Batch *b;
+
+    pthread_mutex_lock(&ring_lock);
+    b = ring[head % QUEUE_LEN];
+    while (!b->done) {
+        pthread_cond_wait(&ring_cond, &ring_lock);
+    }
+    head++;
+    pthread_mutex_unlock(&ring_lock);
+
+    if (!header_written) {
+        write_header();
+    }
+    output(b->out, b->outlen);
+    free(b->recs);
+    free(b->data);
+    free(b->out);
+    free(b);
+}
+
+static void submit(Batch *b)
+{
+    if (!nworkers) {
+        start_workers();
+    }
+    if (submitted - head == QUEUE_LEN) {
+        write_oldest();
+    }
+    pthread_mutex_lock(&ring_lock);
+    ring[submitted++ % QUEUE_LEN] = b;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static bool set_layout(struct reginfo *ri)
+{
+    size_t j;
+    int i;
+
+    layout = xrealloc(NULL, MAX_REGS * sizeof(Field));
+    reginfo_visit(ri, collect_layout, NULL);
+    have_layout = true;
+
+    for (i = 0; i < nfilter; i++) {
+        for (j = 0; j < nlayout; j++) {
+            if (!strcmp(filter[i], layout[j].name)) {
+                break;
+            }
+        }
+        if (j == nlayout) {
+            fprintf(stderr, "Error: --export-fields: no register %s "
+                    "in this trace\n", filter[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool export_record(const trace_header_t *header, struct reginfo *ri,
+                   const void *memblock)
+{
+    uint64_t index = nrecords++;
+    const void *payload = NULL;
+    size_t size = 0;
+    Batch *b;
+    Rec *r;
+
+    if (have_pc_range && (header->pc < pc_start || header->pc >= pc_end)) {
+        return true;
+    }
+
+    switch (header->risu_op) {
+    case OP_COMPARE:
+    case OP_TESTEND:
+    case OP_SIGILL:
+        if (!have_layout && !set_layout(ri)) {
+            return false;
+        }
+        payload = ri;
+        size = header->size;
+        break;
+    case OP_COMPAREMEM:
+        if (filter_mem) {
+            payload = memblock;
+            size = MEMBLOCKLEN;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!current) {
+        current = xrealloc(NULL, sizeof(*current));
+        memset(current, 0, sizeof(*current));
+    }
+    b = current;
+    if (b->n == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : BATCH_RECORDS;
+        b->recs = xrealloc(b->recs, b->cap * sizeof(Rec));
+    }
+    if (b->len + size > b->datacap) {
+        b->datacap = (b->len + size) * 2;
+        b->data = xrealloc(b->data, b->datacap);
+    }
+    r = &b->recs[b->n++];
+    r->index = index;
+    r->pc = header->pc;
+    r->op = header->risu_op;
+    r->size = size;
+    r->offset = b->len;
+    if (size) {
+        memcpy(b->data + b->len, payload, size);
+    }
+    /* Keep each reginfo 16-aligned. */
+    b->len += (size + 15) & ~(size_t)15;
+
+    /*
+     * The columns are only known once a register record has been
+     * seen, so until then the first batch just grows.
+     */
+    if (b->n >= BATCH_RECORDS && have_layout) {
+        submit(b);
+        current = NULL;
+    }
+    return !write_failed;
+}
+
+int export_finish(void)
+{
+    int i;
+
+    if (current) {
+        submit(current);
+        current = NULL;
+    }
+    while (head < submitted) {
+        write_oldest();
+    }
+    if (!header_written) {
+        write_header();
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    finishing = true;
+    pthread_cond_broadcast(&ring_cond);
+    pthread_mutex_unlock(&ring_lock);
+    for (i = 0; i < nworkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    return write_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,1122 @@
+/******************************************************************************
+ * Copyright (c) 2010 Linaro Limited
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Contributors:
+ *     based on Peter Maydell's risu.c
+ *****************************************************************************/
+
+/* The checkpoint engine behind risu: see librisu.h. */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <elf.h>
+
+#include "config.h"
+#include "librisu.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if UINTPTR_MAX == UINT64_MAX
+#define ElfN(x) Elf64_##x
+#define ELFN_ST_TYPE ELF64_ST_TYPE
+#define RISU_ELFCLASS ELFCLASS64
+#else
+#define ElfN(x) Elf32_##x
+#define ELFN_ST_TYPE ELF32_ST_TYPE
+#define RISU_ELFCLASS ELFCLASS32
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RISU_ELFDATA ELFDATA2MSB
+#else
+#define RISU_ELFDATA ELFDATA2LSB
+#endif
+
+#if defined(__aarch64__)
+#define RISU_ELF_MACHINE EM_AARCH64
+#elif defined(__arm__)
+#define RISU_ELF_MACHINE EM_ARM
+#elif defined(__x86_64__)
+#define RISU_ELF_MACHINE EM_X86_64
+#elif defined(__i386__)
+#define RISU_ELF_MACHINE EM_386
+#elif defined(__powerpc64__)
+#define RISU_ELF_MACHINE EM_PPC64
+#elif defined(__m68k__)
+#define RISU_ELF_MACHINE EM_68K
+#elif defined(__s390x__)
+#define RISU_ELF_MACHINE EM_S390
+#elif defined(__loongarch__)
+#define RISU_ELF_MACHINE 258   /* EM_LOONGARCH, missing from older elf.h */
+#else
+#error "unknown host ELF machine"
+#endif
+
+enum {
+    MASTER = 0, APPRENTICE = 1
+};
+
+typedef void entrypoint_fn(void);
+
+struct RisuContext {
+    RisuOptions opts;
+#ifdef HAVE_ZLIB
+    gzFile gz_trace_file;
+#endif
+    ColTrace *col_trace;
+
+    trace_header_t header;
+    struct reginfo ri[2];
+    uint8_t other_memblock[MEMBLOCKLEN];
+    /*
+     * The memory block: a copy, in pages of its own, of the one the
+     * image set at image offset memblock_offset (-1 until it does).
+     */
+    void *memblock;
+    void *memblock_data;
+    size_t memblock_data_len;
+    int64_t memblock_offset;
+    size_t signal_count;
+    uintptr_t last_checkpoint_end;
+    RisuCheckpoint cp;
+    sigjmp_buf jmpbuf;
+
+    /* The image, and for risugen --elf the file it came from. */
+    void *file;
+    size_t file_len;
+    entrypoint_fn *image_start;
+    size_t image_len;
+    const ElfN(Sym) *image_syms;
+    size_t image_nsyms;
+    const char *image_strtab;
+
+    /* Restart snapshot: see risu_resume(). */
+    bool resuming;
+    struct reginfo resume_ri;
+    size_t resume_count;
+    int64_t resume_memblock;
+    uint8_t resume_memdata[MEMBLOCKLEN];
+
+    /*
+     * Over a connection: the features agreed at the handshake, and
+     * for RISU_FEAT_DELTA the previous payload of each kind.
+     */
+    bool handshake_done;
+    uint32_t features;
+    uint8_t *delta_prev[2];
+    uint8_t *delta_buf;
+
+    /* Benchmark: see risu_bench(). */
+    size_t bench_iterations;
+    bool bench_started;
+    uintptr_t bench_head;
+    struct timespec bench_t0;
+    RisuBenchResult *bench;
+};
+
+/*
+ * The arch code finds the image through image_start_address, and the
+ * SIGILL handlers find their context through current; both are set
+ * while an image runs.
+ */
+uintptr_t image_start_address;
+static RisuContext *current;
+
+RisuContext *risu_new(const RisuOptions *opts)
+{
+    RisuContext *ctx = calloc(1, sizeof(*ctx));
+
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->opts = *opts;
+    ctx->memblock_offset = -1;
+    if (opts->trace &&
+        (opts->master ? opts->columnar
+                      : opts->fd != STDIN_FILENO && coltrace_detect(opts->fd))) {
+        ctx->col_trace = coltrace_new(opts->fd, opts->master);
+        if (!ctx->col_trace) {
+            free(ctx);
+            return NULL;
+        }
+        return ctx;
+    }
+#ifdef HAVE_ZLIB
+    if (opts->trace && opts->fd != STDIN_FILENO &&
+        opts->fd != STDOUT_FILENO) {
+        ctx->gz_trace_file = gzdopen(opts->fd, opts->master ? "wb9" : "rb");
+    }
+#endif
+    return ctx;
+}
+
+void risu_free(RisuContext *ctx)
+{
+    if (ctx->col_trace && coltrace_close(ctx->col_trace) != RES_OK) {
+        fprintf(stderr, "error writing columnar trace\n");
+    }
+#ifdef HAVE_ZLIB
+    if (ctx->gz_trace_file) {
+        /* This closes the fd too. */
+        gzclose(ctx->gz_trace_file);
+    } else
+#endif
+    if (ctx->opts.fd >= 0) {
+        close(ctx->opts.fd);
+    }
+    if (ctx->image_start && (void *)ctx->image_start != ctx->file) {
+        munmap(ctx->image_start, ctx->image_len);
+    }
+    if (ctx->file) {
+        munmap(ctx->file, ctx->file_len);
+    }
+    if (ctx->memblock_data) {
+        munmap(ctx->memblock_data, ctx->memblock_data_len);
+    }
+    free(ctx->delta_prev[0]);
+    free(ctx->delta_prev[1]);
+    free(ctx->delta_buf);
+    free(ctx);
+}
+
+/* I/O functions */
+
+static RisuResult read_buffer(RisuContext *ctx, void *ptr, size_t bytes)
+{
+    size_t res;
+
+    if (!ctx->opts.trace) {
+        return recv_data_pkt(ctx->opts.fd, ptr, bytes);
+    }
+    if (ctx->col_trace) {
+        return coltrace_read(ctx->col_trace, ptr, bytes);
+    }
+
+#ifdef HAVE_ZLIB
+    if (ctx->gz_trace_file) {
+        res = gzread(ctx->gz_trace_file, ptr, bytes);
+    } else
+#endif
+    {
+        /* A pipe may give us the data a piece at a time. */
+        uint8_t *p = ptr;
+        ssize_t n = 0;
+
+        for (res = 0; res < bytes; res += n) {
+            n = read(ctx->opts.fd, p + res, bytes - res);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+            } else if (n <= 0) {
+                break;
+            }
+        }
+    }
+
+    return res == bytes ? RES_OK : RES_BAD_IO;
+}
+
+static RisuResult write_buffer(RisuContext *ctx, void *ptr, size_t bytes)
+{
+    size_t res;
+
+    if (!ctx->opts.trace) {
+        return send_data_pkt(ctx->opts.fd, ptr, bytes);
+    }
+    if (ctx->col_trace) {
+        return coltrace_write(ctx->col_trace, ptr, bytes);
+    }
+
+#ifdef HAVE_ZLIB
+    if (ctx->gz_trace_file) {
+        res = gzwrite(ctx->gz_trace_file, ptr, bytes);
+    } else
+#endif
+    {
+        uint8_t *p = ptr;
+        ssize_t n = 0;
+
+        for (res = 0; res < bytes; res += n) {
+            n = write(ctx->opts.fd, p + res, bytes - res);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+            } else if (n <= 0) {
+                break;
+            }
+        }
+    }
+
+    return res == bytes ? RES_OK : RES_BAD_IO;
+}
+
+/*
+ * A record's payload: over a connection which agreed on
+ * RISU_FEAT_DELTA, coded against the previous one of its kind (the
+ * reginfo or the memory block).
+ */
+enum { PAYLOAD_REGINFO, PAYLOAD_MEMBLOCK };
+
+static RisuResult read_payload(RisuContext *ctx, int kind, void *ptr,
+                               size_t bytes)
+{
+    if (ctx->features & RISU_FEAT_DELTA) {
+        return recv_delta_pkt(ctx->opts.fd, ptr, ctx->delta_prev[kind],
+                              bytes, ctx->delta_buf);
+    }
+    return read_buffer(ctx, ptr, bytes);
+}
+
+static RisuResult write_payload(RisuContext *ctx, int kind, void *ptr,
+                                size_t bytes)
+{
+    if (ctx->features & RISU_FEAT_DELTA) {
+        return send_delta_pkt(ctx->opts.fd, ptr, ctx->delta_prev[kind],
+                              bytes, ctx->delta_buf);
+    }
+    return write_buffer(ctx, ptr, bytes);
+}
+
+static void respond(RisuContext *ctx, RisuResult r)
+{
+    if (!ctx->opts.trace) {
+        send_response_byte(ctx->opts.fd, r);
+    }
+}
+
+/*
+ * OP_SETMEMBLOCK: the image names its memory block at addr. Loads and
+ * stores go to a copy of it in separate non-executable pages instead,
+ * so that stores never land in pages holding code; under an emulator
+ * those would invalidate its translations every time. The image finds
+ * the copy through OP_GETMEMBLOCK. A block outside the image (which
+ * risugen never generates) is used where it is.
+ */
+static void set_memblock(RisuContext *ctx, uint64_t addr)
+{
+    uintptr_t start = image_start_address;
+
+    if (addr < start || addr + MEMBLOCKLEN > start + ctx->image_len) {
+        ctx->memblock = (void *)(uintptr_t)addr;
+        ctx->memblock_offset = addr - start;
+        return;
+    }
+    if (ctx->memblock_offset == addr - start &&
+        ctx->memblock == ctx->memblock_data) {
+        /* Setting the same block again keeps what was stored in it. */
+        return;
+    }
+    if (!ctx->memblock_data) {
+        size_t pagesize = sysconf(_SC_PAGESIZE);
+        void *p;
+
+        ctx->memblock_data_len = (MEMBLOCKLEN + pagesize - 1) & -pagesize;
+        p = mmap(0, ctx->memblock_data_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            perror("mmap");
+            abort();
+        }
+        ctx->memblock_data = p;
+    }
+    memcpy(ctx->memblock_data, (void *)(uintptr_t)addr, MEMBLOCKLEN);
+    ctx->memblock = ctx->memblock_data;
+    ctx->memblock_offset = addr - start;
+}
+
+/* Fill in ctx->cp and pass it to the caller's checkpoint hook. */
+static void report_checkpoint(RisuContext *ctx, RisuResult r, bool resynced)
+{
+    RisuCheckpoint *cp = &ctx->cp;
+
+    cp->count = ctx->signal_count;
+    cp->result = r;
+    cp->resynced = resynced;
+    cp->header = &ctx->header;
+    cp->master = &ctx->ri[MASTER];
+    cp->apprentice = ctx->opts.master ? NULL : &ctx->ri[APPRENTICE];
+    cp->block_start = ctx->last_checkpoint_end;
+    cp->memblock = ctx->memblock;
+    cp->memblock_offset = ctx->memblock_offset;
+    if (ctx->opts.checkpoint) {
+        ctx->opts.checkpoint(ctx, cp, ctx->opts.opaque);
+    }
+}
+
+const RisuCheckpoint *risu_last_checkpoint(RisuContext *ctx)
+{
+    return &ctx->cp;
+}
+
+static RisuResult send_register_info(RisuContext *ctx, void *uc, void *siaddr)
+{
+    struct reginfo *ri = &ctx->ri[MASTER];
+    trace_header_t *header = &ctx->header;
+    uint64_t paramreg;
+    RisuResult res;
+    RisuOp op;
+    void *extra;
+
+    reginfo_init(ri, uc, siaddr);
+    op = get_risuop(ri);
+
+    /* Write a header with PC/op to keep in sync */
+    header->magic = RISU_MAGIC;
+    header->pc = get_pc(ri);
+    header->risu_op = op;
+
+    switch (op) {
+    case OP_TESTEND:
+    case OP_COMPARE:
+    case OP_SIGILL:
+        header->size = reginfo_size(ri);
+        extra = ri;
+        break;
+    case OP_COMPAREMEM:
+        header->size = MEMBLOCKLEN;
+        extra = ctx->memblock;
+        break;
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+    case OP_BENCHSTART:
+    case OP_BENCHLOOP:
+        header->size = 0;
+        extra = NULL;
+        break;
+    default:
+        abort();
+    }
+
+    res = write_buffer(ctx, header, sizeof(*header));
+    if (res != RES_OK) {
+        return res;
+    }
+    if (extra) {
+        res = write_payload(ctx, op == OP_COMPAREMEM ? PAYLOAD_MEMBLOCK
+                                                     : PAYLOAD_REGINFO,
+                            extra, header->size);
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+
+    switch (op) {
+    case OP_COMPARE:
+    case OP_SIGILL:
+    case OP_COMPAREMEM:
+    case OP_BENCHSTART:
+    case OP_BENCHLOOP:
+        /* Outside --bench the loop body is just run once. */
+        break;
+    case OP_TESTEND:
+        return RES_END;
+    case OP_SETMEMBLOCK:
+        set_memblock(ctx, get_reginfo_paramreg(ri));
+        break;
+    case OP_GETMEMBLOCK:
+        paramreg = get_reginfo_paramreg(ri);
+        set_ucontext_paramreg(uc, paramreg + (uintptr_t)ctx->memblock);
+        break;
+    default:
+        abort();
+    }
+    return RES_OK;
+}
+
+static void master_sigill(int sig, siginfo_t *si, void *uc)
+{
+    RisuContext *ctx = current;
+    RisuResult r;
+
+    ctx->signal_count++;
+    if (ctx->opts.checkpoint_enter) {
+        ctx->opts.checkpoint_enter(ctx->opts.opaque);
+    }
+    r = send_register_info(ctx, uc, si->si_addr);
+    report_checkpoint(ctx, r, false);
+    if (r == RES_OK) {
+        advance_pc(uc);
+    } else {
+        siglongjmp(ctx->jmpbuf, r);
+    }
+}
+
+static RisuResult recv_register_info(RisuContext *ctx, struct reginfo *ri)
+{
+    trace_header_t *header = &ctx->header;
+    RisuResult res;
+
+    res = read_buffer(ctx, header, sizeof(*header));
+    if (res != RES_OK) {
+        return res;
+    }
+
+    if (header->magic != RISU_MAGIC) {
+        /* If the magic number is wrong, we can't trust the rest. */
+        return RES_BAD_MAGIC;
+    }
+
+    switch (header->risu_op) {
+    case OP_COMPARE:
+    case OP_TESTEND:
+    case OP_SIGILL:
+        /* If we can't store the data, report invalid size. */
+        if (header->size > sizeof(*ri)) {
+            return RES_BAD_SIZE;
+        }
+        respond(ctx, RES_OK);
+        res = read_payload(ctx, PAYLOAD_REGINFO, ri, header->size);
+        if (res == RES_OK && header->size != reginfo_size(ri)) {
+            /* The payload size is not self-consistent with the data. */
+            return RES_BAD_SIZE;
+        }
+        return res;
+
+    case OP_COMPAREMEM:
+        if (header->size != MEMBLOCKLEN) {
+            return RES_BAD_SIZE;
+        }
+        respond(ctx, RES_OK);
+        return read_payload(ctx, PAYLOAD_MEMBLOCK, ctx->other_memblock,
+                            MEMBLOCKLEN);
+
+    case OP_SETMEMBLOCK:
+    case OP_GETMEMBLOCK:
+    case OP_BENCHSTART:
+    case OP_BENCHLOOP:
+        return header->size == 0 ? RES_OK : RES_BAD_SIZE;
+
+    default:
+        return RES_BAD_OP;
+    }
+}
+
+RisuResult risu_read_record(RisuContext *ctx, struct reginfo *ri,
+                            const trace_header_t **header)
+{
+    *header = &ctx->header;
+    return recv_register_info(ctx, ri);
+}
+
+const void *risu_record_memblock(RisuContext *ctx)
+{
+    return ctx->other_memblock;
+}
+
+RisuResult risu_read_raw_record(RisuContext *ctx, void *buf, size_t bufsize,
+                                const trace_header_t **header)
+{
+    trace_header_t *h = &ctx->header;
+    RisuResult res;
+
+    *header = h;
+    res = read_buffer(ctx, h, sizeof(*h));
+    if (res != RES_OK) {
+        return res;
+    }
+    if (h->magic != RISU_MAGIC) {
+        return RES_BAD_MAGIC;
+    }
+    if (h->size > bufsize) {
+        return RES_BAD_SIZE;
+    }
+    return h->size ? read_buffer(ctx, buf, h->size) : RES_OK;
+}
+
+RisuResult risu_copy_trace(RisuContext *from, RisuContext *to)
+{
+    struct reginfo *ri = &from->ri[MASTER];
+    RisuResult res;
+    void *extra;
+
+    for (;;) {
+        res = recv_register_info(from, ri);
+        if (res != RES_OK) {
+            return res;
+        }
+        extra = from->header.risu_op == OP_COMPAREMEM
+                ? (void *)from->other_memblock : (void *)ri;
+        to->header = from->header;
+        res = write_buffer(to, &to->header, sizeof(to->header));
+        if (res == RES_OK && to->header.size) {
+            res = write_buffer(to, extra, to->header.size);
+        }
+        if (res != RES_OK) {
+            return res;
+        }
+        if (from->header.risu_op == OP_TESTEND) {
+            return RES_END;
+        }
+    }
+}
+
+static RisuResult recv_and_compare_register_info(RisuContext *ctx,
+                                                 void *uc, void *siaddr)
+{
+    struct reginfo *ri = ctx->ri;
+    uint64_t paramreg;
+    RisuResult res;
+    RisuOp op;
+
+    reginfo_init(&ri[APPRENTICE], uc, siaddr);
+
+    res = recv_register_info(ctx, &ri[MASTER]);
+    if (res != RES_OK) {
+        goto done;
+    }
+
+    op = get_risuop(&ri[APPRENTICE]);
+
+    switch (op) {
+    case OP_COMPARE:
+    case OP_TESTEND:
+    case OP_SIGILL:
+        /*
+         * If we have nothing to compare against, report an op mismatch.
+         * Otherwise allow the compare to continue, and assume that
+         * something in the reginfo will be different.
+         */
+        if (ctx->header.risu_op != OP_COMPARE &&
+            ctx->header.risu_op != OP_TESTEND &&
+            ctx->header.risu_op != OP_SIGILL) {
+            res = RES_MISMATCH_OP;
+        } else if (!reginfo_is_eq(&ri[MASTER], &ri[APPRENTICE])) {
+            /* register mismatch */
+            res = RES_MISMATCH_REG;
+        } else if (op != ctx->header.risu_op) {
+            /* The reginfo matched.  We should have matched op. */
+            res = RES_MISMATCH_OP;
+        } else if (op == OP_TESTEND) {
+            res = RES_END;
+        }
+        break;
+
+    case OP_SETMEMBLOCK:
+        if (op != ctx->header.risu_op) {
+            res = RES_MISMATCH_OP;
+            break;
+        }
+        set_memblock(ctx, get_reginfo_paramreg(&ri[APPRENTICE]));
+        break;
+
+    case OP_GETMEMBLOCK:
+        if (op != ctx->header.risu_op) {
+            res = RES_MISMATCH_OP;
+            break;
+        }
+        paramreg = get_reginfo_paramreg(&ri[APPRENTICE]);
+        set_ucontext_paramreg(uc, paramreg + (uintptr_t)ctx->memblock);
+        break;
+
+    case OP_COMPAREMEM:
+        if (op != ctx->header.risu_op) {
+            res = RES_MISMATCH_OP;
+            break;
+        }
+        if (memcmp(ctx->memblock, ctx->other_memblock, MEMBLOCKLEN) != 0) {
+            /* memory mismatch */
+            res = RES_MISMATCH_MEM;
+        }
+        break;
+
+    case OP_BENCHSTART:
+    case OP_BENCHLOOP:
+        if (op != ctx->header.risu_op) {
+            res = RES_MISMATCH_OP;
+        }
+        break;
+
+    default:
+        abort();
+    }
+
+ done:
+    /*
+     * On error, tell master to exit, unless we are going to take its
+     * state after a mismatch and carry on.
+     */
+    if (res == RES_OK ||
+        (ctx->opts.keep_going &&
+         (res == RES_MISMATCH_REG || res == RES_MISMATCH_MEM))) {
+        respond(ctx, RES_OK);
+    } else {
+        respond(ctx, RES_END);
+    }
+    return res;
+}
+
+/*
+ * Take the master's state after a mismatch, so that the apprentice
+ * goes on from where the master did, just after its checkpoint.
+ */
+static RisuResult resync_to_master(RisuContext *ctx, void *uc, RisuResult r)
+{
+    if (r == RES_MISMATCH_MEM) {
+        memcpy(ctx->memblock, ctx->other_memblock, MEMBLOCKLEN);
+        advance_pc(uc);
+        return RES_OK;
+    }
+    reginfo_restore(&ctx->ri[MASTER], uc);
+    set_ucontext_pc_after(uc, image_start_address + get_pc(&ctx->ri[MASTER]));
+    return ctx->header.risu_op == OP_TESTEND ? RES_END : RES_OK;
+}
+
+void risu_resume(RisuContext *ctx, struct reginfo *ri, size_t count,
+                 int64_t memblock, const void *memdata)
+{
+    ctx->resume_ri = *ri;
+    ctx->resume_count = count;
+    ctx->resume_memblock = memblock;
+    if (memblock >= 0) {
+        memcpy(ctx->resume_memdata, memdata, MEMBLOCKLEN);
+    }
+    ctx->resuming = true;
+}
+
+/*
+ * The first risuop the apprentice reaches when resuming: replace the
+ * whole register and memory state with the snapshot's and continue
+ * after the snapshot's checkpoint.
+ */
+static void resume_from_snapshot(RisuContext *ctx, void *uc)
+{
+    reginfo_restore(&ctx->resume_ri, uc);
+    set_ucontext_pc_after(uc, image_start_address + get_pc(&ctx->resume_ri));
+    if (ctx->resume_memblock >= 0) {
+        set_memblock(ctx, image_start_address + ctx->resume_memblock);
+        memcpy(ctx->memblock, ctx->resume_memdata, MEMBLOCKLEN);
+    }
+    ctx->signal_count = ctx->resume_count;
+    ctx->last_checkpoint_end = get_ucontext_pc(uc) - image_start_address;
+    ctx->resuming = false;
+}
+
+static void apprentice_sigill(int sig, siginfo_t *si, void *uc)
+{
+    RisuContext *ctx = current;
+    RisuResult r;
+
+    ctx->signal_count++;
+
+    if (ctx->resuming) {
+        resume_from_snapshot(ctx, uc);
+        return;
+    }
+    if (ctx->opts.checkpoint_enter) {
+        ctx->opts.checkpoint_enter(ctx->opts.opaque);
+    }
+    r = recv_and_compare_register_info(ctx, uc, si->si_addr);
+    report_checkpoint(ctx, r, ctx->opts.keep_going &&
+                      (r == RES_MISMATCH_REG || r == RES_MISMATCH_MEM));
+    if (ctx->cp.resynced) {
+        r = resync_to_master(ctx, uc, r);
+    } else if (r == RES_OK) {
+        advance_pc(uc);
+    }
+    if (r == RES_OK) {
+        ctx->last_checkpoint_end = get_ucontext_pc(uc) - image_start_address;
+    } else {
+        siglongjmp(ctx->jmpbuf, r);
+    }
+}
+
+static void set_sigill_handler(void (*fn) (int, siginfo_t *, void *),
+                               struct sigaction *old)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+
+    sa.sa_sigaction = fn;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGILL, &sa, old) != 0) {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* The SIGILL handlers run on an alternate stack, set up once. */
+static void setup_sigaltstack(void)
+{
+    static bool done;
+    stack_t ss;
+
+    if (done) {
+        return;
+    }
+    ss.ss_sp = malloc(SIGSTKSZ);
+    if (ss.ss_sp == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    ss.ss_size = SIGSTKSZ;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL) == -1) {
+        perror("sigaltstack");
+        exit(EXIT_FAILURE);
+    }
+    done = true;
+}
+
+/* Run the image with the given SIGILL handler until it longjmps out. */
+static RisuResult run_image(RisuContext *ctx,
+                            void (*fn) (int, siginfo_t *, void *))
+{
+    struct sigaction old;
+    RisuResult res;
+
+    if (!ctx->image_start) {
+        fprintf(stderr, "no image loaded\n");
+        return RES_BAD_IO;
+    }
+    setup_sigaltstack();
+    current = ctx;
+    image_start_address = (uintptr_t)ctx->image_start;
+
+    res = sigsetjmp(ctx->jmpbuf, 1);
+    if (res == RES_OK) {
+        set_sigill_handler(fn, &old);
+        ctx->image_start();
+        fprintf(stderr, "image returned unexpectedly\n");
+        res = RES_BAD_IO;
+    }
+    sigaction(SIGILL, &old, NULL);
+    current = NULL;
+    return res;
+}
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+/* FNV-1a, to tell whether both ends loaded the same image. */
+uint64_t risu_image_hash(RisuContext *ctx)
+{
+    const uint8_t *p = (const uint8_t *)ctx->image_start;
+    uint64_t h = 0xcbf29ce484222325ull;
+    size_t i;
+
+    for (i = 0; i < ctx->image_len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+static RisuResult handshake(RisuContext *ctx)
+{
+    risu_hello_t hello = {
+        .magic = RISU_HELLO_MAGIC,
+        .version = RISU_PROTOCOL_VERSION,
+        .reginfo_size = sizeof(struct reginfo),
+        .memblock_size = MEMBLOCKLEN,
+        .features = RISU_FEATURES,
+        .image_hash = risu_image_hash(ctx),
+        .arch = XSTR(ARCH),
+    };
+    RisuResult res;
+
+    arch_config(hello.config, sizeof(hello.config));
+    res = risu_handshake(ctx->opts.fd, ctx->opts.master, &hello,
+                         &ctx->features);
+    if (res != RES_OK) {
+        return res;
+    }
+    if (ctx->features & RISU_FEAT_DELTA) {
+        ctx->delta_prev[PAYLOAD_REGINFO] = calloc(1, sizeof(struct reginfo));
+        ctx->delta_prev[PAYLOAD_MEMBLOCK] = calloc(1, MEMBLOCKLEN);
+        ctx->delta_buf = malloc(DELTA_BUF_LEN(sizeof(struct reginfo) >
+                                              MEMBLOCKLEN ?
+                                              sizeof(struct reginfo) :
+                                              MEMBLOCKLEN));
+        if (!ctx->delta_prev[0] || !ctx->delta_prev[1] || !ctx->delta_buf) {
+            return RES_BAD_IO;
+        }
+    }
+    ctx->handshake_done = true;
+    return RES_OK;
+}
+
+RisuResult risu_run(RisuContext *ctx)
+{
+    if (!ctx->opts.trace && !ctx->handshake_done) {
+        RisuResult res;
+
+        if (!ctx->image_start) {
+            fprintf(stderr, "no image loaded\n");
+            return RES_BAD_IO;
+        }
+        res = handshake(ctx);
+        if (res != RES_OK) {
+            return res;
+        }
+    }
+    return run_image(ctx, ctx->opts.master ? master_sigill : apprentice_sigill);
+}
+
+/*
+ * Benchmark mode. risugen --bench generates an image whose body runs
+ * between a BENCHSTART op (with the number of generated insns in the
+ * paramreg) and a BENCHLOOP op. We send the PC back to the BENCHSTART
+ * until the loop has run bench_iterations times, and time each pass.
+ * The first pass includes the cost of translating the body.
+ */
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) * 1e-9;
+}
+
+static void bench_sigill(int sig, siginfo_t *si, void *uc)
+{
+    RisuContext *ctx = current;
+    struct reginfo *ri = &ctx->ri[MASTER];
+    RisuBenchResult *b = ctx->bench;
+    struct timespec now;
+    uint64_t paramreg;
+    double t;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ctx->signal_count++;
+
+    reginfo_init(ri, uc, si->si_addr);
+    ctx->cp.count = ctx->signal_count;
+    ctx->cp.master = ri;
+
+    switch (get_risuop(ri)) {
+    case OP_BENCHSTART:
+        if (!ctx->bench_started) {
+            ctx->bench_started = true;
+            ctx->bench_head = get_pc(ri);
+            b->insns = get_reginfo_paramreg(ri);
+        }
+        advance_pc(uc);
+        /* Leave the handler's own cost out of the timing. */
+        clock_gettime(CLOCK_MONOTONIC, &ctx->bench_t0);
+        return;
+
+    case OP_BENCHLOOP:
+        if (!ctx->bench_started) {
+            siglongjmp(ctx->jmpbuf, RES_BAD_OP);
+        }
+        t = timespec_diff(&ctx->bench_t0, &now);
+        if (b->iterations == 0) {
+            b->cold = t;
+        } else {
+            b->warm += t;
+        }
+        if (++b->iterations < ctx->bench_iterations) {
+            set_ucontext_pc(uc, image_start_address + ctx->bench_head);
+            return;
+        }
+        break;
+
+    case OP_SETMEMBLOCK:
+        set_memblock(ctx, get_reginfo_paramreg(ri));
+        break;
+
+    case OP_GETMEMBLOCK:
+        paramreg = get_reginfo_paramreg(ri);
+        set_ucontext_paramreg(uc, paramreg + (uintptr_t)ctx->memblock);
+        break;
+
+    case OP_COMPARE:
+    case OP_COMPAREMEM:
+        /* Nothing to compare against. */
+        break;
+
+    case OP_TESTEND:
+        siglongjmp(ctx->jmpbuf, RES_END);
+
+    default:
+        siglongjmp(ctx->jmpbuf, RES_BAD_OP);
+    }
+    advance_pc(uc);
+}
+
+RisuResult risu_bench(RisuContext *ctx, size_t iterations,
+                      RisuBenchResult *res)
+{
+    RisuResult r;
+
+    memset(res, 0, sizeof(*res));
+    ctx->bench = res;
+    ctx->bench_iterations = iterations;
+    ctx->bench_started = false;
+    r = run_image(ctx, bench_sigill);
+    if (res->iterations > 1) {
+        res->warm /= res->iterations - 1;
+    }
+    return r;
+}
+
+/* Image loading */
+
+static bool elf_range_ok(size_t len, uint64_t off, uint64_t size)
+{
+    return off <= len && size <= len - off;
+}
+
+/*
+ * Copy the .text section of an ELF image into an anonymous mapping,
+ * and note its symbol table. The file stays mapped for the symbols.
+ */
+static void *load_elf_image(RisuContext *ctx, const char *imgfile,
+                            void *file, size_t len)
+{
+    const ElfN(Ehdr) *eh = file;
+    const ElfN(Shdr) *sh;
+    const char *shstrtab;
+    void *text = NULL;
+    int i;
+
+    if (len < sizeof(*eh) ||
+        eh->e_ident[EI_CLASS] != RISU_ELFCLASS ||
+        eh->e_ident[EI_DATA] != RISU_ELFDATA ||
+        eh->e_type != ET_REL || eh->e_machine != RISU_ELF_MACHINE) {
+        fprintf(stderr, "%s: ELF image is not for this host\n", imgfile);
+        return NULL;
+    }
+    if (eh->e_shentsize != sizeof(*sh) || eh->e_shstrndx >= eh->e_shnum ||
+        !elf_range_ok(len, eh->e_shoff, eh->e_shnum * sizeof(*sh))) {
+        fprintf(stderr, "%s: bad ELF section headers\n", imgfile);
+        return NULL;
+    }
+    sh = file + eh->e_shoff;
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type != SHT_NOBITS &&
+            !elf_range_ok(len, sh[i].sh_offset, sh[i].sh_size)) {
+            fprintf(stderr, "%s: bad ELF section %d\n", imgfile, i);
+            return NULL;
+        }
+    }
+    shstrtab = file + sh[eh->e_shstrndx].sh_offset;
+
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (sh[i].sh_type == SHT_SYMTAB && sh[i].sh_link < eh->e_shnum) {
+            ctx->image_syms = file + sh[i].sh_offset;
+            ctx->image_nsyms = sh[i].sh_size / sizeof(ElfN(Sym));
+            ctx->image_strtab = file + sh[sh[i].sh_link].sh_offset;
+        } else if (!text && sh[i].sh_type == SHT_PROGBITS &&
+                   sh[i].sh_name < sh[eh->e_shstrndx].sh_size &&
+                   strcmp(shstrtab + sh[i].sh_name, ".text") == 0) {
+            ctx->image_len = sh[i].sh_size;
+            text = mmap(0, ctx->image_len, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (text == MAP_FAILED) {
+                perror("mmap");
+                return NULL;
+            }
+            memcpy(text, file + sh[i].sh_offset, ctx->image_len);
+        }
+    }
+    if (!text) {
+        fprintf(stderr, "%s: ELF image has no .text section\n", imgfile);
+    }
+    return text;
+}
+
+bool risu_load_image(RisuContext *ctx, const char *imgfile)
+{
+    /* Load image file into memory as executable */
+    struct stat st;
+    void *addr;
+    size_t len;
+    int fd;
+
+    fd = open(imgfile, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open image file %s\n", imgfile);
+        return false;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return false;
+    }
+    len = st.st_size;
+
+    /* Map writable because we include the memory area for store
+     * testing in the image.
+     */
+    addr = mmap(0, len, PROT_READ | PROT_WRITE | PROT_EXEC,
+                MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+    ctx->file = addr;
+    ctx->file_len = len;
+    ctx->image_len = len;
+
+    /* risugen --elf wraps the image in an ELF object with symbols. */
+    if (len >= SELFMAG && memcmp(addr, ELFMAG, SELFMAG) == 0) {
+        addr = load_elf_image(ctx, imgfile, addr, len);
+        if (!addr) {
+            return false;
+        }
+    }
+    ctx->image_start = addr;
+    /* So that the arch code can already make sense of offsets. */
+    image_start_address = (uintptr_t)addr;
+    return true;
+}
+
+uintptr_t risu_image_address(RisuContext *ctx)
+{
+    return (uintptr_t)ctx->image_start;
+}
+
+size_t risu_image_len(RisuContext *ctx)
+{
+    return ctx->image_len;
+}
+
+/*
+ * Write /tmp/perf-PID.map, which perf uses to name addresses in
+ * anonymous executable mappings, giving one entry for each function
+ * symbol of an ELF image, or a single one for a raw image.
+ */
+bool risu_write_perf_map(RisuContext *ctx)
+{
+    uintptr_t start = (uintptr_t)ctx->image_start;
+    char fn[64];
+    FILE *f;
+    size_t i;
+
+    snprintf(fn, sizeof(fn), "/tmp/perf-%d.map", (int)getpid());
+    f = fopen(fn, "w");
+    if (!f) {
+        perror(fn);
+        return false;
+    }
+    if (ctx->image_syms) {
+        for (i = 0; i < ctx->image_nsyms; i++) {
+            const ElfN(Sym) *sym = &ctx->image_syms[i];
+            if (ELFN_ST_TYPE(sym->st_info) == STT_FUNC && sym->st_size) {
+                fprintf(f, "%" PRIxPTR " %lx %s\n",
+                        start + (uintptr_t)sym->st_value,
+                        (unsigned long)sym->st_size,
+                        ctx->image_strtab + sym->st_name);
+            }
+        }
+    } else {
+        fprintf(f, "%" PRIxPTR " %zx risu_image\n", start, ctx->image_len);
+    }
+    fclose(f);
+    fprintf(stderr, "wrote perf map %s\n", fn);
+    return true;
+}
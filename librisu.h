@@ -0,0 +1,143 @@
+/******************************************************************************
+ * Copyright (c) 2010 Linaro Limited
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *
+ * Contributors:
+ *     based on Peter Maydell's risu.c
+ *****************************************************************************/
+
+/*
+ * librisu: risu's checkpoint engine, for programs which want to run
+ * and compare images themselves rather than through the risu binary.
+ *
+ * A RisuContext holds one end of a comparison: the image, the
+ * transport (a connected socket, or a trace file or pipe) and the
+ * state carried from one checkpoint to the next. The image runs in
+ * the calling process and checkpoints arrive as SIGILLs, so only one
+ * context can run at a time, and the caller must have set up the
+ * architecture (process_arch_opt() and arch_init()) beforehand.
+ */
+
+#ifndef LIBRISU_H
+#define LIBRISU_H
+
+#include "risu.h"
+
+typedef struct RisuContext RisuContext;
+
+/* What happened at one checkpoint. */
+typedef struct {
+    size_t count;               /* checkpoints so far, counting this one */
+    RisuResult result;          /* RES_OK, RES_END or what went wrong */
+    bool resynced;              /* keep_going took the master's state */
+    const trace_header_t *header;   /* as sent by the master */
+    struct reginfo *master;
+    struct reginfo *apprentice; /* NULL at the master end */
+    uintptr_t block_start;      /* image offset of the code run since */
+                                /* the previous checkpoint */
+    void *memblock;             /* NULL until the image sets one */
+    int64_t memblock_offset;    /* image offset the image set it at, */
+                                /* or -1; memblock is a copy of it */
+} RisuCheckpoint;
+
+typedef struct {
+    bool master;
+    int fd;                     /* connected socket, or trace file/pipe */
+    bool trace;                 /* fd is a trace; gzip'd unless stdin/out */
+    /*
+     * The master writes a columnar trace (see columnar.c) rather than
+     * a gzip'd one. The apprentice reads either kind of trace file.
+     */
+    bool columnar;
+    /*
+     * After a register or memory mismatch, take the master's state
+     * and go on, rather than ending the run.
+     */
+    bool keep_going;
+    /* Called on entry to each checkpoint, e.g. to stop a timer. */
+    void (*checkpoint_enter)(void *opaque);
+    /* Called when each checkpoint has been sent or compared. */
+    void (*checkpoint)(RisuContext *ctx, const RisuCheckpoint *cp,
+                       void *opaque);
+    void *opaque;
+} RisuOptions;
+
+typedef struct {
+    size_t iterations;
+    uint64_t insns;             /* per iteration */
+    double cold, warm;          /* seconds; warm is the mean */
+} RisuBenchResult;
+
+RisuContext *risu_new(const RisuOptions *opts);
+
+/* Close the transport (flushing a trace) and unmap the image. */
+void risu_free(RisuContext *ctx);
+
+/* Map a raw or risugen --elf image. Returns false on error. */
+bool risu_load_image(RisuContext *ctx, const char *imgfile);
+uintptr_t risu_image_address(RisuContext *ctx);
+size_t risu_image_len(RisuContext *ctx);
+/* A hash of the loaded image, which the handshake compares. */
+uint64_t risu_image_hash(RisuContext *ctx);
+
+/* Write /tmp/perf-PID.map for the loaded image. */
+bool risu_write_perf_map(RisuContext *ctx);
+
+/*
+ * Run the image to its end or to the first failure. Returns RES_END
+ * if it ran to the end; risu_last_checkpoint() says what happened at
+ * the checkpoint which ended the run. Over a connection the two ends
+ * first check that they are set up alike (see risu_hello_t), and
+ * RES_BAD_HELLO means they were not.
+ */
+RisuResult risu_run(RisuContext *ctx);
+const RisuCheckpoint *risu_last_checkpoint(RisuContext *ctx);
+
+/*
+ * Read the next record from a trace without running anything: the
+ * header, and the reginfo into ri or the memory block into an
+ * internal buffer.
+ */
+RisuResult risu_read_record(RisuContext *ctx, struct reginfo *ri,
+                            const trace_header_t **header);
+
+/* The memory block of the last OP_COMPAREMEM record read. */
+const void *risu_record_memblock(RisuContext *ctx);
+
+/*
+ * Read the next record from a trace without looking inside it: the
+ * header, and its payload into buf (bufsize bytes at most). Traces
+ * recorded on any architecture can be read this way.
+ */
+RisuResult risu_read_raw_record(RisuContext *ctx, void *buf, size_t bufsize,
+                                const trace_header_t **header);
+
+/*
+ * Make the apprentice start from a snapshot taken at checkpoint
+ * count: on reaching its first checkpoint the image takes the state
+ * in ri, and the memory block at image offset memblock (if not -1)
+ * takes the MEMBLOCKLEN bytes at memdata, before going on after the
+ * snapshot's checkpoint. The caller skips the trace up to it.
+ */
+void risu_resume(RisuContext *ctx, struct reginfo *ri, size_t count,
+                 int64_t memblock, const void *memdata);
+
+/*
+ * Copy the records of the trace being read by from to the trace being
+ * written by to (a master context), up to and including the end of
+ * the test. Returns RES_END if it got that far.
+ */
+RisuResult risu_copy_trace(RisuContext *from, RisuContext *to);
+
+/*
+ * Run a risugen --bench image's loop the given number of times with
+ * no comparisons. Returns RES_END when done.
+ */
+RisuResult risu_bench(RisuContext *ctx, size_t iterations,
+                      RisuBenchResult *res);
+
+#endif /* LIBRISU_H */
@@ -0,0 +1,272 @@
+/******************************************************************************
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * Per-pattern timing profile.
+ *
+ * Every checkpoint records how long the image ran since the previous
+ * checkpoint returned to it, so the time spent in risu itself (and on
+ * the socket) is left out. At the end the intervals are attributed to
+ * the patterns which risugen --map says were generated between the two
+ * checkpoints, and we print count, mean, p99 and total per pattern.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "risu.h"
+
+typedef struct {
+    uintptr_t from, to;         /* image offsets of the two checkpoints */
+    uint64_t ns;
+} profile_sample;
+
+typedef struct {
+    uintptr_t offset;
+    int pattern;
+} map_entry;
+
+typedef struct {
+    int pattern;
+    uint64_t ns;
+} pattern_time;
+
+typedef struct {
+    const char *name;
+    size_t count;
+    uint64_t mean, p99, total;
+} pattern_stats;
+
+static profile_sample *samples;
+static size_t nsamples, samples_alloc;
+
+static struct timespec entered, resumed;
+static bool have_resumed;
+static uintptr_t last_pc;
+
+static uint64_t ts_ns(const struct timespec *t)
+{
+    return (uint64_t)t->tv_sec * 1000000000ull + t->tv_nsec;
+}
+
+void profile_checkpoint_enter(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &entered);
+}
+
+void profile_checkpoint_leave(uintptr_t pc)
+{
+    /*
+     * We're called from the SIGILL handler, but the signal is always
+     * raised by the test image and never interrupts risu itself, so
+     * it is safe to allocate here.
+     */
+    if (have_resumed) {
+        if (nsamples == samples_alloc) {
+            samples_alloc = samples_alloc ? samples_alloc * 2 : 4096;
+            samples = realloc(samples, samples_alloc * sizeof(*samples));
+            if (!samples) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        samples[nsamples].from = last_pc;
+        samples[nsamples].to = pc;
+        samples[nsamples].ns = ts_ns(&entered) - ts_ns(&resumed);
+        nsamples++;
+    }
+    last_pc = pc;
+    have_resumed = true;
+    clock_gettime(CLOCK_MONOTONIC, &resumed);
+}
+
+/* Read a map written by risugen --map. Returns false on error. */
+static bool read_map(const char *mapfile, map_entry **mapp, size_t *nentries,
+                     char ***names, int *nnames)
+{
+    FILE *f = fopen(mapfile, "r");
+    map_entry *map = NULL;
+    size_t alloc = 0, n = 0;
+    char line[512];
+    int nn = 1;
+
+    if (!f) {
+        perror(mapfile);
+        return false;
+    }
+    /* Pattern 0 collects the time spent outside any generated insn. */
+    *names = malloc(sizeof(char *));
+    (*names)[0] = strdup("(setup)");
+
+    while (fgets(line, sizeof(line), f)) {
+        char *name, *end;
+        unsigned long off;
+        int i;
+
+        if (line[0] == '#') {
+            continue;
+        }
+        /* offset, size, name */
+        off = strtoul(line, &end, 16);
+        if (end == line || *end != '\t') {
+            continue;
+        }
+        strtoul(end + 1, &name, 10);
+        if (*name != '\t') {
+            continue;
+        }
+        name++;
+        name[strcspn(name, "\n")] = 0;
+
+        /* Names come in runs, so check the most recent one first. */
+        for (i = nn - 1; i > 0; i--) {
+            if (strcmp((*names)[i], name) == 0) {
+                break;
+            }
+        }
+        if (i == 0) {
+            *names = realloc(*names, (nn + 1) * sizeof(char *));
+            (*names)[nn] = strdup(name);
+            i = nn++;
+        }
+
+        if (n == alloc) {
+            alloc = alloc ? alloc * 2 : 4096;
+            map = realloc(map, alloc * sizeof(*map));
+        }
+        map[n].offset = off;
+        map[n].pattern = i;
+        n++;
+    }
+    fclose(f);
+    *mapp = map;
+    *nentries = n;
+    *nnames = nn;
+    return true;
+}
+
+/* Index of the first map entry with offset > off. */
+static size_t map_upper_bound(map_entry *map, size_t n, uintptr_t off)
+{
+    size_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (map[mid].offset <= off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int cmp_pattern_time(const void *a, const void *b)
+{
+    const pattern_time *x = a, *y = b;
+
+    if (x->pattern != y->pattern) {
+        return x->pattern < y->pattern ? -1 : 1;
+    }
+    return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+static int cmp_stats(const void *a, const void *b)
+{
+    const pattern_stats *x = a, *y = b;
+
+    if (x->total != y->total) {
+        return x->total > y->total ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+int profile_report(const char *mapfile, FILE *f)
+{
+    pattern_time *times;
+    pattern_stats *stats;
+    size_t nmap, ntimes = 0, alloc, i, j;
+    map_entry *map;
+    char **names;
+    int nnames, nstats = 0;
+
+    if (!read_map(mapfile, &map, &nmap, &names, &nnames)) {
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Each interval is shared equally between the insns generated
+     * between its two checkpoints; with risugen's default of one
+     * insn per compare that is exactly one pattern.
+     */
+    alloc = nsamples + 1;
+    times = malloc(alloc * sizeof(*times));
+    for (i = 0; i < nsamples; i++) {
+        profile_sample *s = &samples[i];
+        size_t first = 0, last = 0;
+
+        if (s->to > s->from) {
+            first = map_upper_bound(map, nmap, s->from);
+            last = map_upper_bound(map, nmap, s->to - 1);
+        }
+        if (ntimes + (last - first) + 1 > alloc) {
+            alloc = (ntimes + (last - first) + 1) * 2;
+            times = realloc(times, alloc * sizeof(*times));
+        }
+        if (first == last) {
+            times[ntimes].pattern = 0;
+            times[ntimes].ns = s->ns;
+            ntimes++;
+            continue;
+        }
+        for (j = first; j < last; j++) {
+            times[ntimes].pattern = map[j].pattern;
+            times[ntimes].ns = s->ns / (last - first);
+            ntimes++;
+        }
+    }
+
+    qsort(times, ntimes, sizeof(*times), cmp_pattern_time);
+
+    stats = calloc(nnames, sizeof(*stats));
+    for (i = 0; i < ntimes; i = j) {
+        pattern_stats *st = &stats[nstats++];
+        size_t n;
+
+        for (j = i; j < ntimes && times[j].pattern == times[i].pattern; j++) {
+            st->total += times[j].ns;
+        }
+        n = j - i;
+        st->name = names[times[i].pattern];
+        st->count = n;
+        st->mean = st->total / n;
+        st->p99 = times[i + (n * 99 + 99) / 100 - 1].ns;
+    }
+    qsort(stats, nstats, sizeof(*stats), cmp_stats);
+
+    fprintf(f, "# risu profile: %zd intervals, %d patterns\n",
+            nsamples, nstats);
+    fprintf(f, "# %10s %12s %12s %14s  %s\n",
+            "count", "mean_ns", "p99_ns", "total_ns", "pattern");
+    for (i = 0; i < nstats; i++) {
+        fprintf(f, "  %10zd %12" PRIu64 " %12" PRIu64 " %14" PRIu64 "  %s\n",
+                stats[i].count, stats[i].mean, stats[i].p99,
+                stats[i].total, stats[i].name);
+    }
+
+    free(stats);
+    free(times);
+    free(map);
+    for (i = 0; i < nnames; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return EXIT_SUCCESS;
+}
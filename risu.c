@@ -17,387 +17,278 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <signal.h>
-#include <ucontext.h>
-#include <setjmp.h>
 #include <assert.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/wait.h>
 
 #include "config.h"
-#include "risu.h"
+#include "librisu.h"
 
-enum {
-    MASTER = 0, APPRENTICE = 1
-};
+static bool trace;
+static const char *profile_map;
+static int perf_map;
+static int use_unix;
 
-static struct reginfo ri[2];
-static uint8_t other_memblock[MEMBLOCKLEN];
-static trace_header_t header;
+/* Restart snapshots: see write_snapshot() and load_snapshot(). */
+static unsigned long snapshot_every;
+static size_t next_snapshot;
+static FILE *snapshot_file;
+static size_t resume_at;
 
-/* Memblock pointer into the execution image. */
-static void *memblock;
+/* --keep-going: see note_divergence(). */
+static int keep_going;
 
-static int comm_fd;
-static bool trace;
-static size_t signal_count;
+/* Columnar traces: see columnar.c. */
+static int columnar;
 
 #ifdef HAVE_ZLIB
-#include <zlib.h>
-static gzFile gz_trace_file;
 #define TRACE_TYPE "compressed"
 #else
 #define TRACE_TYPE "uncompressed"
 #endif
 
-static sigjmp_buf jmpbuf;
-
 #define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
 
-/* I/O functions */
-
-static RisuResult read_buffer(void *ptr, size_t bytes)
+/*
+ * Called by the master after a compare checkpoint: every snapshot_every
+ * checkpoints, save enough state to resume the apprentice from here.
+ */
+static void write_snapshot(const RisuCheckpoint *cp)
 {
-    size_t res;
-
-    if (!trace) {
-        return recv_data_pkt(comm_fd, ptr, bytes);
-    }
+    snapshot_header_t sh = {
+        .magic = RISU_SNAP_MAGIC,
+        .size = reginfo_size(cp->master),
+        .checkpoint = cp->count,
+        .memblock = cp->memblock_offset,
+    };
 
-#ifdef HAVE_ZLIB
-    if (comm_fd == STDIN_FILENO) {
-#endif
-        res = read(comm_fd, ptr, bytes);
-#ifdef HAVE_ZLIB
-    } else {
-        res = gzread(gz_trace_file, ptr, bytes);
+    if (fwrite(&sh, sizeof(sh), 1, snapshot_file) != 1 ||
+        fwrite(cp->master, sh.size, 1, snapshot_file) != 1 ||
+        (cp->memblock &&
+         fwrite(cp->memblock, MEMBLOCKLEN, 1, snapshot_file) != 1)) {
+        perror("writing snapshot");
+        exit(EXIT_FAILURE);
     }
-#endif
-
-    return res == bytes ? RES_OK : RES_BAD_IO;
+    next_snapshot = cp->count + snapshot_every;
 }
 
-static RisuResult write_buffer(void *ptr, size_t bytes)
+/*
+ * Find the last snapshot in snapfile from before checkpoint resume_at,
+ * skip the trace up to it and have the apprentice start from it.
+ * Returns false if there is none.
+ */
+static bool load_snapshot(RisuContext *ctx, const char *snapfile,
+                          size_t resume_at)
 {
-    size_t res;
-
-    if (!trace) {
-        return send_data_pkt(comm_fd, ptr, bytes);
+    static struct reginfo ri, skip_ri;
+    static uint8_t memdata[MEMBLOCKLEN];
+    snapshot_header_t sh, found = { 0 };
+    const trace_header_t *header;
+    FILE *f = fopen(snapfile, "rb");
+    size_t i;
+
+    if (!f) {
+        perror(snapfile);
+        exit(EXIT_FAILURE);
     }
+    while (fread(&sh, sizeof(sh), 1, f) == 1) {
+        size_t extra = sh.memblock >= 0 ? MEMBLOCKLEN : 0;
 
-#ifdef HAVE_ZLIB
-    if (comm_fd == STDOUT_FILENO) {
-#endif
-        res = write(comm_fd, ptr, bytes);
-#ifdef HAVE_ZLIB
-    } else {
-        res = gzwrite(gz_trace_file, ptr, bytes);
+        if (sh.magic != RISU_SNAP_MAGIC || sh.size > sizeof(ri)) {
+            fprintf(stderr, "%s: bad snapshot\n", snapfile);
+            exit(EXIT_FAILURE);
+        }
+        if (sh.checkpoint >= resume_at) {
+            break;
+        }
+        if (fread(&ri, sh.size, 1, f) != 1 ||
+            (extra && fread(memdata, extra, 1, f) != 1)) {
+            fprintf(stderr, "%s: truncated snapshot\n", snapfile);
+            exit(EXIT_FAILURE);
+        }
+        found = sh;
     }
-#endif
-
-    return res == bytes ? RES_OK : RES_BAD_IO;
-}
+    fclose(f);
 
-static void respond(RisuResult r)
-{
-    if (!trace) {
-        send_response_byte(comm_fd, r);
+    if (found.magic != RISU_SNAP_MAGIC) {
+        return false;
     }
-}
-
-static RisuResult send_register_info(void *uc, void *siaddr)
-{
-    uint64_t paramreg;
-    RisuResult res;
-    RisuOp op;
-    void *extra;
-
-    reginfo_init(&ri[MASTER], uc, siaddr);
-    op = get_risuop(&ri[MASTER]);
-
-    /* Write a header with PC/op to keep in sync */
-    header.magic = RISU_MAGIC;
-    header.pc = get_pc(&ri[MASTER]);
-    header.risu_op = op;
-
-    switch (op) {
-    case OP_TESTEND:
-    case OP_COMPARE:
-    case OP_SIGILL:
-        header.size = reginfo_size(&ri[MASTER]);
-        extra = &ri[MASTER];
-        break;
-    case OP_COMPAREMEM:
-        header.size = MEMBLOCKLEN;
-        extra = memblock;
-        break;
-    case OP_SETMEMBLOCK:
-    case OP_GETMEMBLOCK:
-        header.size = 0;
-        extra = NULL;
-        break;
-    default:
-        abort();
+    if (found.memblock >= (int64_t)risu_image_len(ctx)) {
+        fprintf(stderr, "memory block is outside the image, "
+                "can't resume from a snapshot\n");
+        exit(EXIT_FAILURE);
     }
 
-    res = write_buffer(&header, sizeof(header));
-    if (res != RES_OK) {
-        return res;
-    }
-    if (extra) {
-        res = write_buffer(extra, header.size);
-        if (res != RES_OK) {
-            return res;
+    /* Skip the trace records up to and including the snapshot's. */
+    for (i = 0; i < found.checkpoint; i++) {
+        if (risu_read_record(ctx, &skip_ri, &header) != RES_OK) {
+            fprintf(stderr, "bad trace record %zd before snapshot "
+                    "checkpoint %" PRIu64 "\n", i + 1, found.checkpoint);
+            exit(EXIT_FAILURE);
         }
     }
-
-    switch (op) {
-    case OP_COMPARE:
-    case OP_SIGILL:
-    case OP_COMPAREMEM:
-        break;
-    case OP_TESTEND:
-        return RES_END;
-    case OP_SETMEMBLOCK:
-        paramreg = get_reginfo_paramreg(&ri[MASTER]);
-        memblock = (void *)(uintptr_t)paramreg;
-        break;
-    case OP_GETMEMBLOCK:
-        paramreg = get_reginfo_paramreg(&ri[MASTER]);
-        set_ucontext_paramreg(uc, paramreg + (uintptr_t)memblock);
-        break;
-    default:
-        abort();
-    }
-    return RES_OK;
+    risu_resume(ctx, &ri, found.checkpoint, found.memblock, memdata);
+    fprintf(stderr, "resuming from snapshot at checkpoint %" PRIu64 "\n",
+            found.checkpoint);
+    return true;
 }
 
-static void master_sigill(int sig, siginfo_t *si, void *uc)
+/*
+ * With --keep-going each register or memory mismatch is logged and
+ * counted against the code the apprentice ran since the previous
+ * checkpoint, which with risugen's default of one insn per compare is
+ * just the faulting insn. Only the last DIVERGENCE_CODE_LEN bytes of
+ * longer blocks are kept.
+ */
+#define DIVERGENCE_CODE_LEN 16
+
+typedef struct {
+    RisuResult kind;
+    uint8_t code[DIVERGENCE_CODE_LEN];
+    size_t len;
+    size_t count;
+    size_t first_checkpoint;
+    uintptr_t first_pc;
+} divergence;
+
+static divergence *divergences;
+static size_t ndivergences, divergences_alloc, total_divergences;
+
+static void note_divergence(const RisuCheckpoint *cp)
 {
-    RisuResult r;
-    signal_count++;
-
-    r = send_register_info(uc, si->si_addr);
-    if (r == RES_OK) {
-        advance_pc(uc);
-    } else {
-        siglongjmp(jmpbuf, r);
+    uintptr_t pc = get_pc(cp->apprentice);
+    uintptr_t from = cp->block_start;
+    RisuResult kind = cp->result;
+    const uint8_t *code;
+    divergence *d;
+    size_t len, i;
+
+    fprintf(stderr, "Mismatch %s after %zd checkpoints (pc %#lx), "
+            "continuing with the master's state\n",
+            kind == RES_MISMATCH_REG ? "reg" : "mem",
+            cp->count, (unsigned long)cp->header->pc);
+    if (kind == RES_MISMATCH_REG) {
+        fprintf(stderr, "mismatch detail (master : apprentice):\n");
+        reginfo_dump_mismatch(cp->master, cp->apprentice, stderr);
     }
-}
 
-static RisuResult recv_register_info(struct reginfo *ri)
-{
-    RisuResult res;
-
-    res = read_buffer(&header, sizeof(header));
-    if (res != RES_OK) {
-        return res;
+    if (from > pc) {
+        from = pc;
     }
-
-    if (header.magic != RISU_MAGIC) {
-        /* If the magic number is wrong, we can't trust the rest. */
-        return RES_BAD_MAGIC;
+    len = pc - from;
+    if (len > DIVERGENCE_CODE_LEN) {
+        from = pc - DIVERGENCE_CODE_LEN;
+        len = DIVERGENCE_CODE_LEN;
     }
-
-    switch (header.risu_op) {
-    case OP_COMPARE:
-    case OP_TESTEND:
-    case OP_SIGILL:
-        /* If we can't store the data, report invalid size. */
-        if (header.size > sizeof(*ri)) {
-            return RES_BAD_SIZE;
-        }
-        respond(RES_OK);
-        res = read_buffer(ri, header.size);
-        if (res == RES_OK && header.size != reginfo_size(ri)) {
-            /* The payload size is not self-consistent with the data. */
-            return RES_BAD_SIZE;
+    code = (const uint8_t *)image_start_address + from;
+
+    total_divergences++;
+    for (i = 0; i < ndivergences; i++) {
+        d = &divergences[i];
+        if (d->kind == kind && d->len == len && !memcmp(d->code, code, len)) {
+            d->count++;
+            return;
         }
-        return res;
+    }
 
-    case OP_COMPAREMEM:
-        if (header.size != MEMBLOCKLEN) {
-            return RES_BAD_SIZE;
+    /* As in profile.c, it is safe to allocate in the SIGILL handler. */
+    if (ndivergences == divergences_alloc) {
+        divergences_alloc = divergences_alloc ? divergences_alloc * 2 : 64;
+        divergences = realloc(divergences,
+                              divergences_alloc * sizeof(*divergences));
+        if (!divergences) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
         }
-        respond(RES_OK);
-        return read_buffer(other_memblock, MEMBLOCKLEN);
-
-    case OP_SETMEMBLOCK:
-    case OP_GETMEMBLOCK:
-        return header.size == 0 ? RES_OK : RES_BAD_SIZE;
-
-    default:
-        return RES_BAD_OP;
     }
+    d = &divergences[ndivergences++];
+    d->kind = kind;
+    memcpy(d->code, code, len);
+    d->len = len;
+    d->count = 1;
+    d->first_checkpoint = cp->count;
+    d->first_pc = pc;
 }
 
-static RisuResult recv_and_compare_register_info(void *uc, void *siaddr)
+static int cmp_divergence(const void *a, const void *b)
 {
-    uint64_t paramreg;
-    RisuResult res;
-    RisuOp op;
-
-    reginfo_init(&ri[APPRENTICE], uc, siaddr);
-
-    res = recv_register_info(&ri[MASTER]);
-    if (res != RES_OK) {
-        goto done;
-    }
-
-    op = get_risuop(&ri[APPRENTICE]);
-
-    switch (op) {
-    case OP_COMPARE:
-    case OP_TESTEND:
-    case OP_SIGILL:
-        /*
-         * If we have nothing to compare against, report an op mismatch.
-         * Otherwise allow the compare to continue, and assume that
-         * something in the reginfo will be different.
-         */
-        if (header.risu_op != OP_COMPARE &&
-            header.risu_op != OP_TESTEND &&
-            header.risu_op != OP_SIGILL) {
-            res = RES_MISMATCH_OP;
-        } else if (!reginfo_is_eq(&ri[MASTER], &ri[APPRENTICE])) {
-            /* register mismatch */
-            res = RES_MISMATCH_REG;
-        } else if (op != header.risu_op) {
-            /* The reginfo matched.  We should have matched op. */
-            res = RES_MISMATCH_OP;
-        } else if (op == OP_TESTEND) {
-            res = RES_END;
-        }
-        break;
-
-    case OP_SETMEMBLOCK:
-        if (op != header.risu_op) {
-            res = RES_MISMATCH_OP;
-            break;
-        }
-        paramreg = get_reginfo_paramreg(&ri[APPRENTICE]);
-        memblock = (void *)(uintptr_t)paramreg;
-        break;
+    const divergence *x = a, *y = b;
 
-    case OP_GETMEMBLOCK:
-        if (op != header.risu_op) {
-            res = RES_MISMATCH_OP;
-            break;
-        }
-        paramreg = get_reginfo_paramreg(&ri[APPRENTICE]);
-        set_ucontext_paramreg(uc, paramreg + (uintptr_t)memblock);
-        break;
-
-    case OP_COMPAREMEM:
-        if (op != header.risu_op) {
-            res = RES_MISMATCH_OP;
-            break;
-        }
-        if (memcmp(memblock, other_memblock, MEMBLOCKLEN) != 0) {
-            /* memory mismatch */
-            res = RES_MISMATCH_MEM;
-        }
-        break;
-
-    default:
-        abort();
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
     }
-
- done:
-    /* On error, tell master to exit. */
-    respond(res == RES_OK ? RES_OK : RES_END);
-    return res;
+    return x->first_checkpoint < y->first_checkpoint ? -1 : 1;
 }
 
-static void apprentice_sigill(int sig, siginfo_t *si, void *uc)
+static void divergence_report(FILE *f)
 {
-    RisuResult r;
-    signal_count++;
+    size_t i, j;
 
-    r = recv_and_compare_register_info(uc, si->si_addr);
-    if (r == RES_OK) {
-        advance_pc(uc);
-    } else {
-        siglongjmp(jmpbuf, r);
+    qsort(divergences, ndivergences, sizeof(*divergences), cmp_divergence);
+    fprintf(f, "# %zd divergences at %zd distinct instructions\n",
+            total_divergences, ndivergences);
+    if (!ndivergences) {
+        return;
+    }
+    fprintf(f, "# %8s %12s %10s %4s  %s\n",
+            "count", "first", "first_pc", "kind", "code before checkpoint");
+    for (i = 0; i < ndivergences; i++) {
+        divergence *d = &divergences[i];
+
+        fprintf(f, "  %8zd %12zd %#10lx %4s ", d->count, d->first_checkpoint,
+                (unsigned long)d->first_pc,
+                d->kind == RES_MISMATCH_REG ? "reg" : "mem");
+        for (j = 0; j < d->len; j++) {
+            fprintf(f, " %02x", d->code[j]);
+        }
+        fprintf(f, "\n");
     }
 }
 
-static void set_sigill_handler(void (*fn) (int, siginfo_t *, void *))
+static void checkpoint_enter(void *opaque)
 {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(struct sigaction));
-
-    sa.sa_sigaction = fn;
-    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
-    sigemptyset(&sa.sa_mask);
-    if (sigaction(SIGILL, &sa, 0) != 0) {
-        perror("sigaction");
-        exit(EXIT_FAILURE);
+    if (profile_map) {
+        profile_checkpoint_enter();
     }
 }
 
-typedef void entrypoint_fn(void);
-
-uintptr_t image_start_address;
-static entrypoint_fn *image_start;
-
-static void load_image(const char *imgfile)
+static void checkpoint_done(RisuContext *ctx, const RisuCheckpoint *cp,
+                            void *opaque)
 {
-    /* Load image file into memory as executable */
-    struct stat st;
-    fprintf(stderr, "loading test image %s...\n", imgfile);
-    int fd = open(imgfile, O_RDONLY);
-    if (fd < 0) {
-        fprintf(stderr, "failed to open image file %s\n", imgfile);
-        exit(EXIT_FAILURE);
+    if (profile_map) {
+        profile_checkpoint_leave(get_pc(cp->apprentice ? cp->apprentice
+                                                       : cp->master));
     }
-    if (fstat(fd, &st) != 0) {
-        perror("fstat");
-        exit(EXIT_FAILURE);
+    if (snapshot_file && cp->result == RES_OK &&
+        cp->header->risu_op == OP_COMPARE && cp->count >= next_snapshot) {
+        write_snapshot(cp);
     }
-    size_t len = st.st_size;
-    void *addr;
-
-    /* Map writable because we include the memory area for store
-     * testing in the image.
-     */
-    addr = mmap(0, len, PROT_READ | PROT_WRITE | PROT_EXEC,
-                MAP_PRIVATE, fd, 0);
-    if (addr == MAP_FAILED) {
-        perror("mmap");
-        exit(EXIT_FAILURE);
+    if (cp->resynced) {
+        note_divergence(cp);
     }
-    close(fd);
-    image_start = addr;
-    image_start_address = (uintptr_t) addr;
 }
 
-static int master(void)
+static int master(RisuContext *ctx)
 {
-    RisuResult res = sigsetjmp(jmpbuf, 1);
+    RisuResult res;
 
-    switch (res) {
-    case RES_OK:
-        set_sigill_handler(&master_sigill);
-        fprintf(stderr, "starting master image at 0x%"PRIxPTR"\n",
-                image_start_address);
-        fprintf(stderr, "starting image\n");
-        image_start();
-        fprintf(stderr, "image returned unexpectedly\n");
-        return EXIT_FAILURE;
+    fprintf(stderr, "starting master image at 0x%"PRIxPTR"\n",
+            risu_image_address(ctx));
+    fprintf(stderr, "starting image\n");
+    res = risu_run(ctx);
 
+    switch (res) {
     case RES_END:
-#ifdef HAVE_ZLIB
-        if (trace && comm_fd != STDOUT_FILENO) {
-            gzclose(gz_trace_file);
-        }
-#endif
-        close(comm_fd);
         return EXIT_SUCCESS;
 
     case RES_BAD_IO:
-        fprintf(stderr, "i/o error after %zd checkpoints\n", signal_count);
+        fprintf(stderr, "i/o error after %zd checkpoints\n",
+                risu_last_checkpoint(ctx)->count);
+        return EXIT_FAILURE;
+
+    case RES_BAD_HELLO:
+        /* The handshake has said what was wrong. */
         return EXIT_FAILURE;
 
     default:
@@ -406,7 +297,7 @@ static int master(void)
     }
 }
 
-static const char *op_name(RisuOp op)
+const char *op_name(RisuOp op)
 {
     switch (op) {
     case OP_SIGILL:
@@ -421,61 +312,69 @@ static const char *op_name(RisuOp op)
         return "GETMEMBLOCK";
     case OP_COMPAREMEM:
         return "COMPAREMEM";
+    case OP_BENCHSTART:
+        return "BENCHSTART";
+    case OP_BENCHLOOP:
+        return "BENCHLOOP";
     }
     abort();
 }
 
-static int apprentice(void)
+static int apprentice(RisuContext *ctx)
 {
-    RisuResult res = sigsetjmp(jmpbuf, 1);
+    const RisuCheckpoint *cp;
+    RisuResult res;
 
-    switch (res) {
-    case RES_OK:
-        set_sigill_handler(&apprentice_sigill);
-        fprintf(stderr, "starting apprentice image at 0x%"PRIxPTR"\n",
-                image_start_address);
-        fprintf(stderr, "starting image\n");
-        image_start();
-        fprintf(stderr, "image returned unexpectedly\n");
-        return EXIT_FAILURE;
+    fprintf(stderr, "starting apprentice image at 0x%"PRIxPTR"\n",
+            risu_image_address(ctx));
+    fprintf(stderr, "starting image\n");
+    res = risu_run(ctx);
+    cp = risu_last_checkpoint(ctx);
 
+    switch (res) {
     case RES_END:
-        return EXIT_SUCCESS;
+        return total_divergences ? EXIT_FAILURE : EXIT_SUCCESS;
 
     case RES_MISMATCH_REG:
-        fprintf(stderr, "Mismatch reg after %zd checkpoints\n", signal_count);
+        fprintf(stderr, "Mismatch reg after %zd checkpoints (pc %#lx)\n",
+                cp->count, (unsigned long)cp->header->pc);
         fprintf(stderr, "master reginfo:\n");
-        reginfo_dump(&ri[MASTER], stderr);
+        reginfo_dump(cp->master, stderr);
         fprintf(stderr, "apprentice reginfo:\n");
-        reginfo_dump(&ri[APPRENTICE], stderr);
+        reginfo_dump(cp->apprentice, stderr);
         fprintf(stderr, "mismatch detail (master : apprentice):\n");
-        reginfo_dump_mismatch(&ri[MASTER], &ri[APPRENTICE], stderr);
+        reginfo_dump_mismatch(cp->master, cp->apprentice, stderr);
         return EXIT_FAILURE;
 
     case RES_MISMATCH_MEM:
-        fprintf(stderr, "Mismatch mem after %zd checkpoints\n", signal_count);
+        fprintf(stderr, "Mismatch mem after %zd checkpoints (pc %#lx)\n",
+                cp->count, (unsigned long)cp->header->pc);
         return EXIT_FAILURE;
 
     case RES_MISMATCH_OP:
         /* Out of sync, but both opcodes are known valid. */
-        fprintf(stderr, "Mismatch header after %zd checkpoints\n"
+        fprintf(stderr, "Mismatch header after %zd checkpoints (pc %#lx)\n"
                 "mismatch detail (master : apprentice):\n"
                 "  opcode: %s vs %s\n",
-                signal_count, op_name(header.risu_op),
-                op_name(get_risuop(&ri[APPRENTICE])));
+                cp->count, (unsigned long)cp->header->pc,
+                op_name(cp->header->risu_op),
+                op_name(get_risuop(cp->apprentice)));
         return EXIT_FAILURE;
 
     case RES_BAD_IO:
         fprintf(stderr, "I/O error\n");
         return EXIT_FAILURE;
+    case RES_BAD_HELLO:
+        return EXIT_FAILURE;
     case RES_BAD_MAGIC:
-        fprintf(stderr, "Unexpected magic number: %#08x\n", header.magic);
+        fprintf(stderr, "Unexpected magic number: %#08x\n",
+                cp->header->magic);
         return EXIT_FAILURE;
     case RES_BAD_SIZE:
-        fprintf(stderr, "Unexpected payload size: %u\n", header.size);
+        fprintf(stderr, "Unexpected payload size: %u\n", cp->header->size);
         return EXIT_FAILURE;
     case RES_BAD_OP:
-        fprintf(stderr, "Unexpected opcode: %d\n", header.risu_op);
+        fprintf(stderr, "Unexpected opcode: %d\n", cp->header->risu_op);
         return EXIT_FAILURE;
     default:
         fprintf(stderr, "Unexpected result %d\n", res);
@@ -483,8 +382,75 @@ static int apprentice(void)
     }
 }
 
-static int dump_trace(bool isfull)
+static size_t bench_iterations = 100;
+
+static int bench(RisuContext *ctx)
 {
+    RisuBenchResult b;
+    RisuResult res;
+
+    fprintf(stderr, "starting benchmark image at 0x%"PRIxPTR"\n",
+            risu_image_address(ctx));
+    res = risu_bench(ctx, bench_iterations, &b);
+
+    switch (res) {
+    case RES_END:
+        break;
+
+    case RES_BAD_OP:
+        fprintf(stderr, "Unexpected %s at image offset %#lx\n",
+                op_name(get_risuop(risu_last_checkpoint(ctx)->master)),
+                (unsigned long)get_pc(risu_last_checkpoint(ctx)->master));
+        return EXIT_FAILURE;
+
+    default:
+        fprintf(stderr, "Unexpected result %d\n", res);
+        return EXIT_FAILURE;
+    }
+
+    if (!b.iterations) {
+        fprintf(stderr, "image has no benchmark loop "
+                "(generate one with risugen --bench)\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%zd iterations of %" PRIu64 " insns\n", b.iterations, b.insns);
+    printf("cold: %10.3f ms/iteration %14.0f insns/s\n",
+           b.cold * 1e3, b.insns / b.cold);
+    if (b.iterations > 1) {
+        printf("warm: %10.3f ms/iteration %14.0f insns/s\n",
+               b.warm * 1e3, b.insns / b.warm);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Report why a trace record could not be read. */
+static int bad_record(RisuResult res, const trace_header_t *header)
+{
+    switch (res) {
+    case RES_BAD_IO:
+        fprintf(stderr, "I/O error\n");
+        break;
+    case RES_BAD_MAGIC:
+        fprintf(stderr, "Unexpected magic number: %#08x\n", header->magic);
+        break;
+    case RES_BAD_SIZE:
+        fprintf(stderr, "Unexpected payload size: %u\n", header->size);
+        break;
+    case RES_BAD_OP:
+        fprintf(stderr, "Unexpected opcode: %d\n", header->risu_op);
+        break;
+    default:
+        fprintf(stderr, "Unexpected recv result %d\n", res);
+        break;
+    }
+    return EXIT_FAILURE;
+}
+
+static int dump_trace(RisuContext *ctx, bool isfull)
+{
+    static struct reginfo ri[2];
+    const trace_header_t *header;
     RisuResult res;
     int tick = 0;
 
@@ -492,16 +458,16 @@ static int dump_trace(bool isfull)
         struct reginfo *this_ri;
 
         this_ri = &ri[tick & 1];
-        res = recv_register_info(this_ri);
+        res = risu_read_record(ctx, this_ri, &header);
 
         switch (res) {
         case RES_OK:
-            switch (header.risu_op) {
+            switch (header->risu_op) {
             case OP_COMPARE:
             case OP_TESTEND:
             case OP_SIGILL:
-                printf("%s: (pc %#lx)\n", op_name(header.risu_op),
-                       (unsigned long)header.pc);
+                printf("%s: (pc %#lx)\n", op_name(header->risu_op),
+                       (unsigned long)header->pc);
 
                 if (isfull || tick == 0) {
                     reginfo_dump(this_ri, stdout);
@@ -520,7 +486,7 @@ static int dump_trace(bool isfull)
                     }
                 }
                 putchar('\n');
-                if (header.risu_op == OP_TESTEND) {
+                if (header->risu_op == OP_TESTEND) {
                     return EXIT_SUCCESS;
                 }
                 tick++;
@@ -530,28 +496,314 @@ static int dump_trace(bool isfull)
                 /* TODO: Dump 8k of data? */
                 /* fall through */
             default:
-                printf("%s\n", op_name(header.risu_op));
+                printf("%s\n", op_name(header->risu_op));
                 break;
             }
             break;
 
-        case RES_BAD_IO:
-            fprintf(stderr, "I/O error\n");
-            return EXIT_FAILURE;
-        case RES_BAD_MAGIC:
-            fprintf(stderr, "Unexpected magic number: %#08x\n", header.magic);
-            return EXIT_FAILURE;
-        case RES_BAD_SIZE:
-            fprintf(stderr, "Unexpected payload size: %u\n", header.size);
+        default:
+            return bad_record(res, header);
+        }
+    }
+}
+
+/*
+ * Read the whole trace and print statistics about it as JSON: see
+ * analyze.c.
+ */
+static int analyze(RisuContext *ctx)
+{
+    static struct reginfo ri;
+    const trace_header_t *header;
+    RisuResult res;
+
+    do {
+        res = risu_read_record(ctx, &ri, &header);
+        if (res != RES_OK) {
+            return bad_record(res, header);
+        }
+        analyze_record(header, &ri);
+    } while (header->risu_op != OP_TESTEND);
+
+    return analyze_report(stdout);
+}
+
+/* Write the trace out for other tools to read: see export.c. */
+static int export_trace(RisuContext *ctx)
+{
+    static struct reginfo ri;
+    const trace_header_t *header;
+    RisuResult res;
+
+    do {
+        res = risu_read_record(ctx, &ri, &header);
+        if (res != RES_OK) {
+            export_finish();
+            return bad_record(res, header);
+        }
+        if (!export_record(header, &ri, risu_record_memblock(ctx))) {
             return EXIT_FAILURE;
-        case RES_BAD_OP:
-            fprintf(stderr, "Unexpected opcode: %d\n", header.risu_op);
+        }
+    } while (header->risu_op != OP_TESTEND);
+
+    return export_finish();
+}
+
+/*
+ * Copy the trace being read by ctx to outfn, as a columnar trace with
+ * --columnar and otherwise as a row trace, gzip'd if it is a file.
+ */
+static int transcode(RisuContext *ctx, const char *outfn)
+{
+    RisuOptions opts = {
+        .master = true,
+        .trace = true,
+        .columnar = columnar,
+    };
+    RisuContext *out;
+    RisuResult res;
+
+    if (strcmp(outfn, "-") == 0) {
+        opts.fd = STDOUT_FILENO;
+    } else {
+        opts.fd = open(outfn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (opts.fd < 0) {
+            perror(outfn);
             return EXIT_FAILURE;
-        default:
-            fprintf(stderr, "Unexpected recv result %d\n", res);
+        }
+    }
+    out = risu_new(&opts);
+    if (!out) {
+        perror(outfn);
+        return EXIT_FAILURE;
+    }
+    res = risu_copy_trace(ctx, out);
+    risu_free(out);
+    risu_free(ctx);
+    if (res != RES_END) {
+        fprintf(stderr, "transcode: bad trace record (%d)\n", res);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Peer mode: run this risu twice, as master under the first command
+ * prefix and as apprentice under the second, talking over a
+ * socketpair, so that two models are compared as they run without a
+ * trace file. Both get our own command line, less the --peer options.
+ */
+static const char *peer_prefix[2];
+static int npeers;
+
+static void append_quoted(char *cmd, const char *arg)
+{
+    char *p = cmd + strlen(cmd);
+
+    *p++ = ' ';
+    *p++ = '\'';
+    for (; *arg; arg++) {
+        if (*arg == '\'') {
+            strcpy(p, "'\\''");
+            p += 4;
+        } else {
+            *p++ = *arg;
+        }
+    }
+    *p++ = '\'';
+    *p = 0;
+}
+
+static char *peer_command(int which, int argc, char **argv)
+{
+    size_t len = strlen(peer_prefix[which]) + 64;
+    char *cmd;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        len += strlen(argv[i]) * 4 + 3;
+    }
+    cmd = malloc(len);
+    strcpy(cmd, peer_prefix[which]);
+
+    append_quoted(cmd, argv[0]);
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--peer=", 7) == 0) {
+            continue;
+        }
+        if (strcmp(argv[i], "--peer") == 0) {
+            i++;
+            continue;
+        }
+        append_quoted(cmd, argv[i]);
+    }
+    if (which == 0) {
+        append_quoted(cmd, "--master");
+    }
+    return cmd;
+}
+
+/* Report how a child risu ended; returns our exit status for it. */
+static int child_result(const char *what, int status)
+{
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+        return EXIT_SUCCESS;
+    }
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "%s killed by signal %d\n", what, WTERMSIG(status));
+    } else {
+        fprintf(stderr, "%s exited with status %d\n",
+                what, WEXITSTATUS(status));
+    }
+    return EXIT_FAILURE;
+}
+
+static int run_peers(int argc, char **argv)
+{
+    static const char *const role[2] = { "peer master", "peer apprentice" };
+    pid_t pid[2];
+    int i, fd, status, ret = EXIT_SUCCESS, running = 2;
+    char *cmd;
+
+    cmd = peer_command(1, argc, argv);
+    fprintf(stderr, "%s: %s\n", role[1], cmd);
+    fd = spawn_with_socketpair(cmd, &pid[1]);
+    free(cmd);
+
+    /* The master gets the other end of the apprentice's socketpair. */
+    cmd = peer_command(0, argc, argv);
+    cmd = realloc(cmd, strlen(cmd) + 32);
+    sprintf(cmd + strlen(cmd), " --fd=%d", fd);
+    fprintf(stderr, "%s: %s\n", role[0], cmd);
+    pid[0] = fork();
+    if (pid[0] < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid[0] == 0) {
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        perror("/bin/sh");
+        _exit(127);
+    }
+    free(cmd);
+    close(fd);
+
+    while (running) {
+        pid_t p = wait(&status);
+
+        if (p < 0) {
+            perror("wait");
             return EXIT_FAILURE;
         }
+        i = p == pid[1];
+        if (p != pid[i]) {
+            continue;
+        }
+        running--;
+        pid[i] = 0;
+        if (child_result(role[i], status) == EXIT_SUCCESS) {
+            continue;
+        }
+        ret = EXIT_FAILURE;
+        /* Don't leave the other side running on its own. */
+        if (pid[!i]) {
+            kill(pid[!i], SIGTERM);
+        }
+    }
+    return ret;
+}
+
+static char *sweep_filename(const char *base, const char *name)
+{
+    char *fn = malloc(strlen(base) + strlen(name) + 2);
+
+    sprintf(fn, "%s.%s", base, name);
+    return fn;
+}
+
+/*
+ * For an arch option like --test-sve=sweep: fork a child for each
+ * configuration, all running at once. Each child returns, with its
+ * configuration selected and its stderr going to a file of its own,
+ * to run the image; the parent waits for them all, reports on each
+ * (with the output of those which failed) and exits. An apprentice
+ * may be able to run configurations its master's system could not,
+ * so one with no master (see EXIT_NO_MASTER) is skipped, not failed.
+ */
+static void run_sweep(int n, char *name, size_t len, int *num)
+{
+    pid_t *pid = calloc(n, sizeof(pid_t));
+    FILE **log = calloc(n, sizeof(FILE *));
+    char **names = calloc(n, sizeof(char *));
+    int i, status, failed = 0, skipped = 0, running = 0;
+
+    fflush(NULL);
+    for (i = 0; i < n; i++) {
+        *num = arch_sweep_select(i, name, len);
+        names[i] = strdup(name);
+        log[i] = tmpfile();
+        if (!log[i]) {
+            perror("tmpfile");
+            exit(EXIT_FAILURE);
+        }
+        pid[i] = fork();
+        if (pid[i] < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid[i] == 0) {
+            dup2(fileno(log[i]), STDERR_FILENO);
+            return;
+        }
+        running++;
+    }
+
+    while (running) {
+        pid_t p = wait(&status);
+
+        if (p < 0) {
+            perror("wait");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n && pid[i] != p; i++) {
+            continue;
+        }
+        if (i == n) {
+            continue;
+        }
+        running--;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_NO_MASTER) {
+            fprintf(stderr, "sweep: no master for %s\n", names[i]);
+            pid[i] = -1;
+            skipped++;
+            continue;
+        }
+        pid[i] = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+        if (!pid[i]) {
+            char buf[4096];
+            size_t got;
+
+            failed++;
+            fprintf(stderr, "--- %s:\n", names[i]);
+            rewind(log[i]);
+            while ((got = fread(buf, 1, sizeof(buf), log[i])) > 0) {
+                fwrite(buf, 1, got, stderr);
+            }
+            child_result(names[i], status);
+        }
     }
+
+    fprintf(stderr, "sweep:");
+    for (i = 0; i < n; i++) {
+        fprintf(stderr, " %s %s", names[i],
+                pid[i] > 0 ? "ok" : pid[i] ? "skipped" : "FAILED");
+    }
+    fprintf(stderr, "\n%d of %d passed", n - skipped - failed, n - skipped);
+    if (skipped) {
+        fprintf(stderr, " (%d with no master skipped)", skipped);
+    }
+    fprintf(stderr, "\n");
+    exit(failed || skipped == n ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 enum {
@@ -559,6 +811,10 @@ enum {
     DO_MASTER,
     DO_FULLDUMP,
     DO_DIFFDUMP,
+    DO_BENCH,
+    DO_ANALYZE,
+    DO_EXPORT,
+    DO_CHUNK,
 };
 
 static int operation = DO_APPRENTICE;
@@ -566,7 +822,8 @@ static int operation = DO_APPRENTICE;
 static void usage(void)
 {
     fprintf(stderr,
-            "Usage: risu [--master|--fulldump|--diffdump]\n"
+            "Usage: risu [--master|--fulldump|--diffdump|--analyze[=N]|\n"
+            "             --export=FMT|--bench[=N]]\n"
             "            [--host <ip>] [--port <port>] <image file>\n"
             "\n"
             "Run through the pattern file verifying each instruction\n"
@@ -576,7 +833,51 @@ static void usage(void)
             "  --master          Be the master (server)\n"
             "  --fulldump        Dump each record\n"
             "  --diffdump        Dump difference between each record\n"
+            "  --analyze[=N]     Print statistics about a trace as JSON:\n"
+            "                    register changes, flag bits, FP value\n"
+            "                    classes and checkpoints per N bytes of\n"
+            "                    the image (default 256)\n"
+            "  --export=FMT      Write each record of the trace to stdout\n"
+            "                    as jsonl, csv or bin (see README)\n"
+            "  --export-fields=LIST  With --export, only these registers\n"
+            "                    (comma separated; \"mem\" for memory)\n"
+            "  --export-pc=START-END  With --export, only the records\n"
+            "                    with START <= pc < END\n"
+            "  --bench[=N]       Time N runs (default 100) of the loop in a\n"
+            "                    benchmark image, without a master\n"
             "  -t, --trace=FILE  Record/playback " TRACE_TYPE " trace file\n"
+            "  --columnar        With --master -t FILE or --transcode, write a\n"
+            "                    columnar trace; playback detects them\n"
+            "  --transcode=OUT   Copy the trace given by -t to OUT, converting\n"
+            "                    it to or from a columnar trace\n"
+            "  --serve-trace=FILE  Play the trace FILE to each apprentice\n"
+            "                    which connects to --port, as its master;\n"
+            "                    with an image, check that they run it\n"
+            "  --chunk           Split stdin into chunks for risu-store,\n"
+            "                    each written to stdout after its length\n"
+            "  --profile=MAP     Report time per insn pattern, using the\n"
+            "                    map written by risugen --map\n"
+            "  --perf-map        Write /tmp/perf-PID.map naming the image's\n"
+            "                    symbols at the address it is loaded at\n"
+            "  --snapshot-every=N  With --master -t FILE, save the state to\n"
+            "                    FILE.snap every N checkpoints\n"
+            "  --resume-at=N     With -t FILE, start from the last snapshot\n"
+            "                    in FILE.snap before checkpoint N\n"
+            "  --peer=PREFIX     Given twice, run the image as master under\n"
+            "                    the first command prefix and as apprentice\n"
+            "                    under the second, and compare them\n"
+            "  --keep-going      After a register or memory mismatch, take\n"
+            "                    the master's state and carry on; report\n"
+            "                    all mismatches at the end\n"
+            "  --rendezvous=FILE  Master: listen on an unused port and write\n"
+            "                    its address to FILE (\"-\" for stdout);\n"
+            "                    apprentice: connect to the address in FILE\n"
+            "  --unix            With --rendezvous, use an abstract Unix\n"
+            "                    socket rather than TCP\n"
+            "  --spawn=CMD       Master: run the apprentice command CMD\n"
+            "                    connected over a socketpair\n"
+            "  --fd=N            Talk over file descriptor N, which is\n"
+            "                    already connected (as set up by --spawn)\n"
             "  -h, --host=HOST   Specify master host machine\n"
             "  -p, --port=PORT   Specify the port to connect to/listen on "
             "(default 9191)\n");
@@ -592,9 +893,28 @@ static struct option * setup_options(char **short_opts)
         {"master", no_argument, &operation, DO_MASTER},
         {"fulldump", no_argument, &operation, DO_FULLDUMP},
         {"diffdump", no_argument, &operation, DO_DIFFDUMP},
+        {"analyze", optional_argument, 0, 'A'},
+        {"export", required_argument, 0, 'X'},
+        {"export-fields", required_argument, 0, 'F'},
+        {"export-pc", required_argument, 0, 'C'},
         {"host", required_argument, 0, 'h'},
         {"port", required_argument, 0, 'p'},
         {"trace", required_argument, 0, 't'},
+        {"bench", optional_argument, 0, 'b'},
+        {"profile", required_argument, 0, 'P'},
+        {"perf-map", no_argument, &perf_map, 1},
+        {"snapshot-every", required_argument, 0, 'S'},
+        {"resume-at", required_argument, 0, 'R'},
+        {"keep-going", no_argument, &keep_going, 1},
+        {"peer", required_argument, 0, 'E'},
+        {"rendezvous", required_argument, 0, 'z'},
+        {"unix", no_argument, &use_unix, 1},
+        {"spawn", required_argument, 0, 'x'},
+        {"fd", required_argument, 0, 'f'},
+        {"columnar", no_argument, &columnar, 1},
+        {"transcode", required_argument, 0, 'T'},
+        {"serve-trace", required_argument, 0, 'V'},
+        {"chunk", no_argument, &operation, DO_CHUNK},
         {0, 0, 0, 0}
     };
     struct option *lopts = &default_longopts[0];
@@ -628,10 +948,21 @@ int main(int argc, char **argv)
     char *hostname = "localhost";
     char *imgfile;
     char *trace_fn = NULL;
+    const char *rendezvous = NULL, *spawn_cmd = NULL, *transcode_fn = NULL;
+    const char *serve_fn = NULL;
+    int nsweep;
+    int connected_fd = -1;
+    pid_t spawned_pid = 0;
     struct option *longopts;
     char *shortopts;
-    stack_t ss;
+    RisuOptions opts = {
+        .checkpoint_enter = checkpoint_enter,
+        .checkpoint = checkpoint_done,
+    };
+    RisuContext *ctx;
+    int comm_fd = -1;
     bool ismaster;
+    int ret;
 
     longopts = setup_options(&shortopts);
 
@@ -657,6 +988,83 @@ int main(int argc, char **argv)
             /* FIXME err handling */
             port = strtol(optarg, 0, 10);
             break;
+        case 'b':
+            operation = DO_BENCH;
+            if (optarg) {
+                bench_iterations = strtoul(optarg, 0, 10);
+                if (bench_iterations == 0) {
+                    fprintf(stderr, "Error: --bench needs at least 1 "
+                            "iteration\n");
+                    return EXIT_FAILURE;
+                }
+            }
+            break;
+        case 'A':
+            operation = DO_ANALYZE;
+            if (optarg) {
+                unsigned long bytes = strtoul(optarg, 0, 10);
+
+                if (bytes == 0) {
+                    fprintf(stderr, "Error: --analyze needs a PC range of "
+                            "at least 1 byte\n");
+                    return EXIT_FAILURE;
+                }
+                analyze_set_pc_bucket(bytes);
+            }
+            break;
+        case 'X':
+            operation = DO_EXPORT;
+            if (!export_set_format(optarg)) {
+                fprintf(stderr, "Error: --export format must be jsonl, "
+                        "csv or bin\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            export_set_fields(optarg);
+            break;
+        case 'C':
+            if (!export_set_pc_range(optarg)) {
+                fprintf(stderr, "Error: --export-pc needs START-END, "
+                        "with END above START\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            profile_map = optarg;
+            break;
+        case 'S':
+            snapshot_every = strtoul(optarg, 0, 10);
+            if (snapshot_every == 0) {
+                fprintf(stderr, "Error: --snapshot-every needs at least 1\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            resume_at = strtoul(optarg, 0, 10);
+            break;
+        case 'E':
+            if (npeers == 2) {
+                fprintf(stderr, "Error: --peer given more than twice\n");
+                return EXIT_FAILURE;
+            }
+            peer_prefix[npeers++] = optarg;
+            break;
+        case 'z':
+            rendezvous = optarg;
+            break;
+        case 'x':
+            spawn_cmd = optarg;
+            break;
+        case 'f':
+            connected_fd = strtol(optarg, 0, 10);
+            break;
+        case 'T':
+            transcode_fn = optarg;
+            break;
+        case 'V':
+            serve_fn = optarg;
+            break;
         case '?':
             usage();
             return EXIT_FAILURE;
@@ -669,7 +1077,88 @@ int main(int argc, char **argv)
 
     ismaster = operation == DO_MASTER;
 
-    if (trace) {
+    if (npeers) {
+        if (npeers != 2 || trace || operation != DO_APPRENTICE) {
+            fprintf(stderr, "Error: --peer must be given twice, and "
+                    "without --master, --trace or a dump/bench mode\n");
+            return EXIT_FAILURE;
+        }
+        return run_peers(argc, argv);
+    }
+
+    if (serve_fn) {
+        uint64_t hash = 0;
+
+        if (trace || operation != DO_APPRENTICE || rendezvous ||
+            spawn_cmd || connected_fd >= 0 || argc - optind > 1) {
+            fprintf(stderr, "Error: --serve-trace only takes --port "
+                    "and the image\n");
+            return EXIT_FAILURE;
+        }
+        /* So that apprentices running another image are turned away. */
+        if (optind < argc) {
+            opts.fd = -1;
+            ctx = risu_new(&opts);
+            if (!ctx || !risu_load_image(ctx, argv[optind])) {
+                return EXIT_FAILURE;
+            }
+            hash = risu_image_hash(ctx);
+            risu_free(ctx);
+        }
+        return serve_trace(serve_fn, port, hash);
+    }
+
+    if (operation == DO_CHUNK) {
+        if (trace || transcode_fn || rendezvous || spawn_cmd ||
+            connected_fd >= 0 || optind < argc) {
+            fprintf(stderr, "Error: --chunk takes no other options\n");
+            return EXIT_FAILURE;
+        }
+        return chunk_stream(stdin, stdout);
+    }
+
+    if (transcode_fn && (!trace || operation != DO_APPRENTICE)) {
+        fprintf(stderr, "Error: --transcode needs a trace to read with -t, "
+                "and no --master or dump/bench mode\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((snapshot_every || resume_at) &&
+        (!trace || strcmp(trace_fn, "-") == 0 ||
+         operation != (snapshot_every ? DO_MASTER : DO_APPRENTICE))) {
+        fprintf(stderr, "Error: --snapshot-every needs --master and "
+                "--resume-at the apprentice, both with a trace file\n");
+        return EXIT_FAILURE;
+    }
+
+    nsweep = arch_sweep_count();
+    if (nsweep) {
+        char name[32];
+        int num;
+
+        if ((operation != DO_MASTER && operation != DO_APPRENTICE) ||
+            transcode_fn || spawn_cmd || connected_fd >= 0 ||
+            snapshot_every || resume_at ||
+            (trace && strcmp(trace_fn, "-") == 0)) {
+            fprintf(stderr, "Error: a sweep needs a trace file, "
+                    "--rendezvous or --port, and none of the other modes\n");
+            return EXIT_FAILURE;
+        }
+        run_sweep(nsweep, name, sizeof(name), &num);
+
+        /* Each child has a trace, rendezvous file or port of its own. */
+        if (trace) {
+            trace_fn = sweep_filename(trace_fn, name);
+        }
+        if (rendezvous) {
+            rendezvous = sweep_filename(rendezvous, name);
+        }
+        port += num;
+    }
+
+    if (operation == DO_BENCH) {
+        /* A benchmark runs on its own. */
+    } else if (trace) {
         if (strcmp(trace_fn, "-") == 0) {
             comm_fd = ismaster ? STDOUT_FILENO : STDIN_FILENO;
         } else {
@@ -678,9 +1167,23 @@ int main(int argc, char **argv)
             } else {
                 comm_fd = open(trace_fn, O_RDONLY);
             }
-#ifdef HAVE_ZLIB
-            gz_trace_file = gzdopen(comm_fd, ismaster ? "wb9" : "rb");
-#endif
+            if (comm_fd < 0) {
+                int missing = errno == ENOENT;
+
+                perror(trace_fn);
+                return missing && !ismaster ? EXIT_NO_MASTER : EXIT_FAILURE;
+            }
+        }
+    } else if (connected_fd >= 0) {
+        comm_fd = connected_fd;
+    } else if (spawn_cmd && ismaster) {
+        fprintf(stderr, "master: running %s\n", spawn_cmd);
+        comm_fd = spawn_with_socketpair(spawn_cmd, &spawned_pid);
+    } else if (rendezvous) {
+        if (ismaster) {
+            comm_fd = master_rendezvous(rendezvous, use_unix);
+        } else {
+            comm_fd = apprentice_rendezvous(rendezvous, hostname);
         }
     } else {
         if (ismaster) {
@@ -692,8 +1195,28 @@ int main(int argc, char **argv)
         }
     }
 
+    opts.master = ismaster;
+    opts.fd = comm_fd;
+    opts.trace = trace;
+    opts.keep_going = keep_going;
+    opts.columnar = columnar;
+    ctx = risu_new(&opts);
+    if (!ctx) {
+        perror("risu_new");
+        return EXIT_FAILURE;
+    }
+
     if (operation == DO_FULLDUMP || operation == DO_DIFFDUMP) {
-        return dump_trace(operation == DO_FULLDUMP);
+        return dump_trace(ctx, operation == DO_FULLDUMP);
+    }
+    if (operation == DO_ANALYZE) {
+        return analyze(ctx);
+    }
+    if (operation == DO_EXPORT) {
+        return export_trace(ctx);
+    }
+    if (transcode_fn) {
+        return transcode(ctx, transcode_fn);
     }
 
     imgfile = argv[optind];
@@ -703,27 +1226,61 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
-    load_image(imgfile);
-
-    /* create alternate stack */
-    ss.ss_sp = malloc(SIGSTKSZ);
-    if (ss.ss_sp == NULL) {
-        perror("malloc");
-        exit(EXIT_FAILURE);
+    fprintf(stderr, "loading test image %s...\n", imgfile);
+    if (!risu_load_image(ctx, imgfile)) {
+        return EXIT_FAILURE;
     }
-    ss.ss_size = SIGSTKSZ;
-    ss.ss_flags = 0;
-    if (sigaltstack(&ss, NULL) == -1) {
-        perror("sigaltstac");
-        exit(EXIT_FAILURE);
+    if (perf_map && !risu_write_perf_map(ctx)) {
+        return EXIT_FAILURE;
+    }
+
+    if (snapshot_every || resume_at) {
+        char *snapfile = malloc(strlen(trace_fn) + 6);
+
+        sprintf(snapfile, "%s.snap", trace_fn);
+        if (snapshot_every) {
+            snapshot_file = fopen(snapfile, "wb");
+            if (!snapshot_file) {
+                perror(snapfile);
+                return EXIT_FAILURE;
+            }
+        } else if (!load_snapshot(ctx, snapfile, resume_at)) {
+            fprintf(stderr, "no snapshot before checkpoint %zd, "
+                    "starting from the beginning\n", resume_at);
+        }
+        free(snapfile);
     }
 
     /* E.g. select requested SVE vector length. */
     arch_init();
 
-    if (ismaster) {
-        return master();
-    } else {
-        return apprentice();
+    if (operation == DO_BENCH) {
+        return bench(ctx);
+    }
+
+    ret = ismaster ? master(ctx) : apprentice(ctx);
+    /* This also flushes a trace. */
+    risu_free(ctx);
+    if (spawned_pid > 0) {
+        int status;
+
+        /* A mismatch is reported by the apprentice. */
+        if (waitpid(spawned_pid, &status, 0) < 0) {
+            perror("waitpid");
+            ret = EXIT_FAILURE;
+        } else if (child_result("apprentice", status) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+    if (keep_going && !ismaster) {
+        divergence_report(stderr);
+    }
+    if (snapshot_file && fclose(snapshot_file) != 0) {
+        perror("writing snapshot");
+        ret = EXIT_FAILURE;
+    }
+    if (profile_map && profile_report(profile_map, stderr) != EXIT_SUCCESS) {
+        ret = EXIT_FAILURE;
     }
+    return ret;
 }
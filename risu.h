@@ -14,6 +14,7 @@
 
 #include <inttypes.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <ucontext.h>
 #include <stdio.h>
 #include <getopt.h>
@@ -24,6 +25,16 @@ extern const struct option * const arch_long_opts;
 extern const char * const arch_extra_help;
 void process_arch_opt(int opt, const char *arg);
 void arch_init(void);
+/* Describe the arch options which change the reginfo, for the handshake. */
+void arch_config(char *buf, size_t len);
+/*
+ * For an option like --test-sve=sweep: the number of configurations
+ * to run the image in (0 if not sweeping), and in the child for
+ * configuration i, select it before arch_init(), naming it in buf.
+ * Returns its number, which offsets the child's --port.
+ */
+int arch_sweep_count(void);
+int arch_sweep_select(int i, char *name, size_t len);
 #define FIRST_ARCH_OPT   0x100
 
 /* GCC computed include to pull in the correct risu_reginfo_*.h for
@@ -48,6 +59,8 @@ typedef enum {
     OP_SETMEMBLOCK = 2,
     OP_GETMEMBLOCK = 3,
     OP_COMPAREMEM = 4,
+    OP_BENCHSTART = 5,
+    OP_BENCHLOOP = 6,
 } RisuOp;
 
 /* Result of operation */
@@ -61,6 +74,7 @@ typedef enum {
     RES_BAD_MAGIC,
     RES_BAD_SIZE,
     RES_BAD_OP,
+    RES_BAD_HELLO,      /* the two ends are not set up alike */
 } RisuResult;
 
 /* The memory block should be this long */
@@ -82,12 +96,108 @@ typedef struct {
 
 #define RISU_MAGIC  (('R' << 24) | ('I' << 16) | ('S' << 8) | 'U')
 
+/*
+ * A restart snapshot, written by the master with --snapshot-every.
+ * It is followed by the reginfo (size bytes) and, if memblock is not
+ * -1, the MEMBLOCKLEN bytes of the memory block at that image offset.
+ */
+typedef struct {
+   uint32_t magic;
+   uint32_t size;
+   uint64_t checkpoint;
+   int64_t memblock;
+} snapshot_header_t;
+
+#define RISU_SNAP_MAGIC  (('S' << 24) | ('N' << 16) | ('A' << 8) | 'P')
+
+/*
+ * Sent by each end of a connection before the first record: see
+ * risu_handshake(). A field left zero or empty is not known to the
+ * sender (--serve-trace knows nothing of the image, say) and is not
+ * checked.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t reginfo_size;      /* sizeof(struct reginfo) */
+    uint32_t memblock_size;
+    uint32_t features;          /* the RISU_FEAT_* the sender supports */
+    uint32_t reserved;
+    uint64_t image_hash;
+    char arch[16];
+    char config[64];            /* from arch_config() */
+} risu_hello_t;
+
+#define RISU_HELLO_MAGIC  (('H' << 24) | ('E' << 16) | ('L' << 8) | 'O')
+#define RISU_PROTOCOL_VERSION  1
+
+/* Payloads are sent as deltas: see send_delta_pkt(). */
+#define RISU_FEAT_DELTA   (1 << 0)
+#define RISU_FEATURES     RISU_FEAT_DELTA
+
+/* Room for a payload of len bytes coded by send_delta_pkt(). */
+#define DELTA_BUF_LEN(len)  (2 * (len) + 8)
+
+/*
+ * The exit status of an apprentice which found no master to talk to,
+ * nor a trace from one: in a sweep, a configuration the master's
+ * system doesn't support.
+ */
+#define EXIT_NO_MASTER  2
+
 /* Socket related routines */
+int master_listen(int port);
 int master_connect(int port);
 int apprentice_connect(const char *hostname, int port);
+int master_rendezvous(const char *file, bool use_unix);
+int apprentice_rendezvous(const char *file, const char *hostname);
+int spawn_with_socketpair(const char *cmd, pid_t *pid);
 RisuResult send_data_pkt(int sock, void *pkt, int pktlen);
+RisuResult try_send_data_pkt(int sock, void *pkt, int pktlen);
 RisuResult recv_data_pkt(int sock, void *pkt, int pktlen);
+RisuResult try_recv_data_pkt(int sock, void *pkt, int pktlen);
+RisuResult send_delta_pkt(int sock, const void *pkt, void *prev, int pktlen,
+                          void *buf);
+RisuResult recv_delta_pkt(int sock, void *pkt, void *prev, int pktlen,
+                          void *buf);
 void send_response_byte(int sock, int resp);
+RisuResult risu_handshake(int sock, bool master, const risu_hello_t *mine,
+                          uint32_t *features);
+
+/* Columnar traces (columnar.c) */
+typedef struct ColTrace ColTrace;
+bool coltrace_detect(int fd);
+ColTrace *coltrace_new(int fd, bool writing);
+RisuResult coltrace_write(ColTrace *ct, const void *data, size_t len);
+RisuResult coltrace_read(ColTrace *ct, void *data, size_t len);
+RisuResult coltrace_close(ColTrace *ct);
+
+/* Trace statistics for --analyze (analyze.c) */
+void analyze_set_pc_bucket(size_t bytes);
+void analyze_record(const trace_header_t *header, struct reginfo *ri);
+int analyze_report(FILE *f);
+
+/* Structured trace export for --export (export.c) */
+bool export_set_format(const char *format);
+void export_set_fields(const char *fields);
+bool export_set_pc_range(const char *range);
+bool export_record(const trace_header_t *header, struct reginfo *ri,
+                   const void *memblock);
+int export_finish(void);
+
+/* Trace server for --serve-trace (serve.c) */
+int serve_trace(const char *trace_fn, int port, uint64_t image_hash);
+
+/* Content-defined chunking for risu-store (chunk.c) */
+int chunk_stream(FILE *in, FILE *out);
+
+/* Name of a risu op, for reports (risu.c) */
+const char *op_name(RisuOp op);
+
+/* Per-pattern timing profile (profile.c) */
+void profile_checkpoint_enter(void);
+void profile_checkpoint_leave(uintptr_t pc);
+int profile_report(const char *mapfile, FILE *f);
 
 /* Functions operating on reginfo */
 
@@ -96,6 +206,18 @@ void send_response_byte(int sock, int resp);
 /* Move the PC past this faulting insn by adjusting ucontext. */
 void advance_pc(void *uc);
 
+/* Set the PC in a ucontext_t to the specified address. */
+void set_ucontext_pc(void *vuc, uintptr_t pc);
+
+/*
+ * Set the PC in a ucontext_t to just after the risuop at the specified
+ * address, as advance_pc() does for the risuop which trapped.
+ */
+void set_ucontext_pc_after(void *vuc, uintptr_t pc);
+
+/* Return the PC from a ucontext_t. */
+uintptr_t get_ucontext_pc(void *vuc);
+
 /* Set the parameter register in a ucontext_t to the specified value.
  * (32-bit targets can ignore high 32 bits.)
  * vuc is a ucontext_t* cast to void*.
@@ -117,6 +239,12 @@ uintptr_t get_pc(struct reginfo *ri);
 /* initialize structure from a ucontext */
 void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr);
 
+/*
+ * Write the state held in a reginfo back into a ucontext, except for
+ * the PC and the stack pointer, to resume from a snapshot.
+ */
+void reginfo_restore(struct reginfo *ri, ucontext_t *uc);
+
 /* return true if structs are equal, false otherwise. */
 bool reginfo_is_eq(struct reginfo *r1, struct reginfo *r2);
 
@@ -126,6 +254,25 @@ void reginfo_dump(struct reginfo *ri, FILE *f);
 /* reginfo_dump_mismatch: print mismatch details to a stream */
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f);
 
+/* How --analyze treats a register: see reginfo_visit(). */
+typedef enum {
+    RISU_REG_INT,       /* changes counted only */
+    RISU_REG_FLAGS,     /* and how often each bit is set */
+    RISU_REG_FP,        /* and the class of each 64-bit float lane */
+    RISU_REG_VEC,       /* and of each 32-bit and 64-bit float lane */
+} RisuRegClass;
+
+typedef void reginfo_visit_fn(void *opaque, const char *name,
+                              RisuRegClass cls, const void *data,
+                              size_t size);
+
+/*
+ * Call fn for each register reginfo_dump() prints, in the same order,
+ * with its name, class and contents. The order and sizes only change
+ * if the register set does (e.g. a different vector length).
+ */
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque);
+
 /* return size of reginfo */
 int reginfo_size(struct reginfo *ri);
 
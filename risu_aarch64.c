@@ -18,6 +18,24 @@ void advance_pc(void *vuc)
     uc->uc_mcontext.pc += 4;
 }
 
+void set_ucontext_pc(void *vuc, uintptr_t pc)
+{
+    ucontext_t *uc = vuc;
+    uc->uc_mcontext.pc = pc;
+}
+
+void set_ucontext_pc_after(void *vuc, uintptr_t pc)
+{
+    set_ucontext_pc(vuc, pc);
+    advance_pc(vuc);
+}
+
+uintptr_t get_ucontext_pc(void *vuc)
+{
+    ucontext_t *uc = vuc;
+    return uc->uc_mcontext.pc;
+}
+
 void set_ucontext_paramreg(void *vuc, uint64_t value)
 {
     ucontext_t *uc = vuc;
@@ -44,6 +44,25 @@ void advance_pc(void *vuc)
     uc->uc_mcontext.arm_pc += insnsize(uc);
 }
 
+void set_ucontext_pc(void *vuc, uintptr_t pc)
+{
+    /* The caller is responsible for staying in the same ARM/Thumb state */
+    ucontext_t *uc = vuc;
+    uc->uc_mcontext.arm_pc = pc;
+}
+
+void set_ucontext_pc_after(void *vuc, uintptr_t pc)
+{
+    set_ucontext_pc(vuc, pc);
+    advance_pc(vuc);
+}
+
+uintptr_t get_ucontext_pc(void *vuc)
+{
+    ucontext_t *uc = vuc;
+    return uc->uc_mcontext.arm_pc;
+}
+
 
 void set_ucontext_paramreg(void *vuc, uint64_t value)
 {
@@ -21,6 +21,24 @@ void advance_pc(void *vuc)
     uc->uc_mcontext.sc_pc += 4;
 }
 
+void set_ucontext_pc(void *vuc, uintptr_t pc)
+{
+    struct ucontext *uc = vuc;
+    uc->uc_mcontext.sc_pc = pc;
+}
+
+void set_ucontext_pc_after(void *vuc, uintptr_t pc)
+{
+    set_ucontext_pc(vuc, pc);
+    advance_pc(vuc);
+}
+
+uintptr_t get_ucontext_pc(void *vuc)
+{
+    struct ucontext *uc = vuc;
+    return uc->uc_mcontext.sc_pc;
+}
+
 void set_ucontext_paramreg(void *vuc, uint64_t value)
 {
     struct ucontext *uc = vuc;
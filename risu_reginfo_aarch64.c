@@ -32,6 +32,9 @@
 /* Should we test SVE register state */
 static int test_sve;
 static int test_za;
+/* --test-sve=sweep and --test-za=sweep: each VQ the system supports */
+static bool sweep_sve, sweep_za;
+static int sweep_vq[SVE_VQ_MAX];
 static const struct option extra_opts[] = {
     {"test-sve", required_argument, NULL, FIRST_ARCH_OPT },
     {"test-za", required_argument, NULL, FIRST_ARCH_OPT + 1 },
@@ -41,12 +44,18 @@ static const struct option extra_opts[] = {
 const struct option * const arch_long_opts = &extra_opts[0];
 const char * const arch_extra_help
     = "  --test-sve=<vq>        Compare SVE registers with VQ\n"
-      "  --test-za=<vq>         Compare ZA storage with VQ\n";
+      "  --test-za=<vq>         Compare ZA storage with VQ\n"
+      "  --test-sve=sweep, --test-za=sweep\n"
+      "                         Run once for each VQ supported, in parallel\n";
 
 void process_arch_opt(int opt, const char *arg)
 {
     switch (opt) {
     case FIRST_ARCH_OPT:
+        if (!strcmp(arg, "sweep")) {
+            sweep_sve = true;
+            break;
+        }
         test_sve = strtol(arg, 0, 10);
         if (test_sve <= 0 || test_sve > SVE_VQ_MAX) {
             fprintf(stderr, "Invalid value for SVE VQ (1-%d)\n", SVE_VQ_MAX);
@@ -54,6 +63,10 @@ void process_arch_opt(int opt, const char *arg)
         }
         break;
     case FIRST_ARCH_OPT + 1:
+        if (!strcmp(arg, "sweep")) {
+            sweep_za = true;
+            break;
+        }
         test_za = strtol(arg, 0, 10);
         if (test_za <= 0 || test_za > SVE_VQ_MAX
             || (test_za & (test_za - 1))) {
@@ -112,6 +125,65 @@ void arch_init(void)
     }
 }
 
+int arch_sweep_count(void)
+{
+    int n = 0, vq;
+
+    if (!sweep_sve && !sweep_za) {
+        return 0;
+    }
+    if ((sweep_sve && test_za) || (sweep_za && test_sve)) {
+        fprintf(stderr, "A sweep of SVE or ZA VQs needs the other to be "
+                "swept too, or not tested\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /*
+     * The kernel rounds a vector length down to one it supports, so
+     * the VQs which come back as asked for are the ones to run. This
+     * only changes our own VL; each child sets its own in arch_init().
+     */
+    for (vq = 1; vq <= SVE_VQ_MAX; vq++) {
+        long vl = sve_vl_from_vq(vq);
+
+        if (sweep_za && (vq & (vq - 1))) {
+            continue;
+        }
+        if (sweep_za && prctl(PR_SME_SET_VL, vl) != vl) {
+            continue;
+        }
+        if (sweep_sve && prctl(PR_SVE_SET_VL, vl) != vl) {
+            continue;
+        }
+        sweep_vq[n++] = vq;
+    }
+    if (n == 0) {
+        fprintf(stderr, "System does not support %s\n",
+                sweep_za ? "SME" : "SVE");
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+int arch_sweep_select(int i, char *name, size_t len)
+{
+    int vq = sweep_vq[i];
+
+    if (sweep_sve) {
+        test_sve = vq;
+    }
+    if (sweep_za) {
+        test_za = vq;
+    }
+    snprintf(name, len, "vq%d", vq);
+    return vq;
+}
+
+void arch_config(char *buf, size_t len)
+{
+    snprintf(buf, len, "test-sve=%d test-za=%d", test_sve, test_za);
+}
+
 int reginfo_size(struct reginfo *ri)
 {
     int size = offsetof(struct reginfo, extra);
@@ -129,39 +201,27 @@ int reginfo_size(struct reginfo *ri)
 }
 
 /* reginfo_init: initialize with a ucontext */
-void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
+/* Find the FP/SIMD, SVE and ZA records in the signal frame. */
+static void find_sigcontexts(ucontext_t *uc, struct fpsimd_context **fp,
+                             risu_sve_context **sve, risu_za_context **za)
 {
-    int i, vq;
     struct _aarch64_ctx *ctx, *extra = NULL;
-    struct fpsimd_context *fp = NULL;
-    risu_sve_context *sve = NULL;
-    risu_za_context *za = NULL;
 
-    /* necessary to be able to compare with memcmp later */
-    memset(ri, 0, sizeof(*ri));
-
-    for (i = 0; i < 31; i++) {
-        ri->regs[i] = uc->uc_mcontext.regs[i];
-    }
-
-    ri->sp = 0xdeadbeefdeadbeef;
-    ri->pc = uc->uc_mcontext.pc - image_start_address;
-    ri->flags = uc->uc_mcontext.pstate & 0xf0000000;    /* get only flags */
-
-    ri->fault_address = uc->uc_mcontext.fault_address;
-    ri->faulting_insn = *((uint32_t *) uc->uc_mcontext.pc);
+    *fp = NULL;
+    *sve = NULL;
+    *za = NULL;
 
     ctx = (struct _aarch64_ctx *) &uc->uc_mcontext.__reserved[0];
     while (ctx) {
         switch (ctx->magic) {
         case FPSIMD_MAGIC:
-            fp = (void *)ctx;
+            *fp = (void *)ctx;
             break;
         case SVE_MAGIC:
-            sve = (void *)ctx;
+            *sve = (void *)ctx;
             break;
         case ZA_MAGIC:
-            za = (void *)ctx;
+            *za = (void *)ctx;
             break;
         case EXTRA_MAGIC:
             extra = (void *)((struct extra_context *)(ctx))->datap;
@@ -177,6 +237,30 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
         }
         ctx = (void *)ctx + ctx->size;
     }
+}
+
+void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
+{
+    int i, vq;
+    struct fpsimd_context *fp;
+    risu_sve_context *sve;
+    risu_za_context *za;
+
+    /* necessary to be able to compare with memcmp later */
+    memset(ri, 0, sizeof(*ri));
+
+    for (i = 0; i < 31; i++) {
+        ri->regs[i] = uc->uc_mcontext.regs[i];
+    }
+
+    ri->sp = 0xdeadbeefdeadbeef;
+    ri->pc = uc->uc_mcontext.pc - image_start_address;
+    ri->flags = uc->uc_mcontext.pstate & 0xf0000000;    /* get only flags */
+
+    ri->fault_address = uc->uc_mcontext.fault_address;
+    ri->faulting_insn = *((uint32_t *) uc->uc_mcontext.pc);
+
+    find_sigcontexts(uc, &fp, &sve, &za);
 
     if (!fp || fp->head.size != sizeof(*fp)) {
         fprintf(stderr, "risu_reginfo_aarch64: failed to get FP/SIMD state\n");
@@ -262,6 +346,53 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
     }
 }
 
+/* reginfo_restore: write the compared state back into a ucontext */
+void reginfo_restore(struct reginfo *ri, ucontext_t *uc)
+{
+    int i, vq = test_sve | test_za;
+    struct fpsimd_context *fp;
+    risu_sve_context *sve;
+    risu_za_context *za;
+
+    for (i = 0; i < 31; i++) {
+        uc->uc_mcontext.regs[i] = ri->regs[i];
+    }
+    uc->uc_mcontext.pstate =
+        (uc->uc_mcontext.pstate & ~0xf0000000ull) | ri->flags;
+
+    find_sigcontexts(uc, &fp, &sve, &za);
+    if (!fp || fp->head.size != sizeof(*fp)) {
+        fprintf(stderr, "risu_reginfo_aarch64: failed to get FP/SIMD state\n");
+        return;
+    }
+    fp->fpsr = ri->fpsr;
+    fp->fpcr = ri->fpcr;
+
+    /*
+     * ZA and SVE state can only be written back if the frame has room
+     * for it, ie if the apprentice already has ZA enabled and is using
+     * SVE; a snapshot doesn't change PSTATE.{SM,ZA}.
+     */
+    if (za && (ri->svcr & SVCR_ZA) &&
+        za->head.size >= ZA_SIG_CONTEXT_SIZE(vq)) {
+        memcpy((char *)za + ZA_SIG_REGS_OFFSET, reginfo_zav(ri, vq, 0),
+               ZA_SIG_CONTEXT_SIZE(vq) - ZA_SIG_REGS_OFFSET);
+    }
+    if (vq && sve && sve->head.size >= SVE_SIG_CONTEXT_SIZE(vq)) {
+        memcpy((char *)sve + SVE_SIG_REGS_OFFSET, reginfo_zreg(ri, vq, 0),
+               SVE_SIG_REGS_SIZE(vq));
+        return;
+    }
+
+    if (vq == 0) {
+        memcpy(fp->vregs, reginfo_vreg(ri, 0), RISU_SIMD_REGS_SIZE);
+    } else {
+        for (i = 0; i < 32; ++i) {
+            memcpy(&fp->vregs[i], reginfo_zreg(ri, vq, i), 16);
+        }
+    }
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns true if equal */
 bool reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
 {
@@ -385,6 +516,53 @@ void reginfo_dump(struct reginfo *ri, FILE * f)
     }
 }
 
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque)
+{
+    char name[16];
+    int i;
+
+    for (i = 0; i < 31; i++) {
+        snprintf(name, sizeof(name), "X%d", i);
+        fn(opaque, name, RISU_REG_INT, &ri->regs[i], sizeof(ri->regs[i]));
+    }
+    fn(opaque, "sp", RISU_REG_INT, &ri->sp, sizeof(ri->sp));
+    fn(opaque, "pc", RISU_REG_INT, &ri->pc, sizeof(ri->pc));
+    fn(opaque, "flags", RISU_REG_FLAGS, &ri->flags, sizeof(ri->flags));
+    fn(opaque, "fpsr", RISU_REG_FLAGS, &ri->fpsr, sizeof(ri->fpsr));
+    fn(opaque, "fpcr", RISU_REG_FLAGS, &ri->fpcr, sizeof(ri->fpcr));
+
+    if (ri->sve_vl) {
+        int vl = ri->sve_vl;
+        int vq = sve_vq_from_vl(vl);
+
+        fn(opaque, "svcr", RISU_REG_FLAGS, &ri->svcr, sizeof(ri->svcr));
+        for (i = 0; i < SVE_NUM_ZREGS; i++) {
+            snprintf(name, sizeof(name), "Z%d", i);
+            fn(opaque, name, RISU_REG_VEC, reginfo_zreg(ri, vq, i), vq * 16);
+        }
+        for (i = 0; i < SVE_NUM_PREGS + 1; i++) {
+            if (i == SVE_NUM_PREGS) {
+                snprintf(name, sizeof(name), "FFR");
+            } else {
+                snprintf(name, sizeof(name), "P%d", i);
+            }
+            fn(opaque, name, RISU_REG_INT, reginfo_preg(ri, vq, i), vq * 2);
+        }
+        if (ri->svcr & SVCR_ZA) {
+            for (i = 0; i < vl; ++i) {
+                snprintf(name, sizeof(name), "ZA[%d]", i);
+                fn(opaque, name, RISU_REG_VEC, reginfo_zav(ri, vq, i), vq * 16);
+            }
+        }
+        return;
+    }
+
+    for (i = 0; i < 32; i++) {
+        snprintf(name, sizeof(name), "V%d", i);
+        fn(opaque, name, RISU_REG_VEC, reginfo_vreg(ri, i), 16);
+    }
+}
+
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE * f)
 {
     int i;
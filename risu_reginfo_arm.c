@@ -40,6 +40,21 @@ void arch_init(void)
 {
 }
 
+int arch_sweep_count(void)
+{
+    return 0;
+}
+
+int arch_sweep_select(int i, char *name, size_t len)
+{
+    abort();
+}
+
+void arch_config(char *buf, size_t len)
+{
+    snprintf(buf, len, "test-fp-exc=%d", test_fp_exc);
+}
+
 int reginfo_size(struct reginfo *ri)
 {
     return sizeof(*ri);
@@ -155,6 +170,61 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
     reginfo_init_vfp(ri, uc);
 }
 
+static void reginfo_restore_vfp(struct reginfo *ri, ucontext_t *uc)
+{
+    unsigned long *rs = uc->uc_regspace;
+
+    for (;;) {
+        unsigned long magic = *rs++;
+        unsigned long size = *rs++;
+
+        size -= 8;
+
+        if (magic == 0) {
+            return;
+        }
+        if (magic == 0x56465001 && size >= ((32 * 2) + 1) * 4) {
+            int i;
+            for (i = 0; i < 32; i++) {
+                *rs++ = (uint32_t)ri->fpregs[i];
+                *rs++ = ri->fpregs[i] >> 32;
+            }
+            *rs = (*rs & ~0xffff9f9f) | ri->fpscr;
+            return;
+        }
+        rs += size / 4;
+    }
+}
+
+/* reginfo_restore: write the compared state back into a ucontext */
+void reginfo_restore(struct reginfo *ri, ucontext_t *uc)
+{
+    uc->uc_mcontext.arm_r0 = ri->gpreg[0];
+    uc->uc_mcontext.arm_r1 = ri->gpreg[1];
+    uc->uc_mcontext.arm_r2 = ri->gpreg[2];
+    uc->uc_mcontext.arm_r3 = ri->gpreg[3];
+    uc->uc_mcontext.arm_r4 = ri->gpreg[4];
+    uc->uc_mcontext.arm_r5 = ri->gpreg[5];
+    uc->uc_mcontext.arm_r6 = ri->gpreg[6];
+    uc->uc_mcontext.arm_r7 = ri->gpreg[7];
+    uc->uc_mcontext.arm_r8 = ri->gpreg[8];
+    uc->uc_mcontext.arm_r9 = ri->gpreg[9];
+    uc->uc_mcontext.arm_r10 = ri->gpreg[10];
+    uc->uc_mcontext.arm_fp = ri->gpreg[11];
+    uc->uc_mcontext.arm_ip = ri->gpreg[12];
+    uc->uc_mcontext.arm_lr = ri->gpreg[14];
+    uc->uc_mcontext.arm_cpsr =
+        (uc->uc_mcontext.arm_cpsr & ~0xF80F0000) | ri->cpsr;
+    /* Thumb risuops are the only 16 bit ones. */
+    if (ri->faulting_insn_size == 2) {
+        uc->uc_mcontext.arm_cpsr |= 0x20;
+    } else {
+        uc->uc_mcontext.arm_cpsr &= ~0x20;
+    }
+
+    reginfo_restore_vfp(ri, uc);
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns true if equal */
 bool reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
 {
@@ -181,6 +251,24 @@ void reginfo_dump(struct reginfo *ri, FILE *f)
     fprintf(f, "  fpscr: %08x\n", ri->fpscr);
 }
 
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque)
+{
+    char name[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "r%d", i);
+        fn(opaque, name, RISU_REG_INT, &ri->gpreg[i], sizeof(ri->gpreg[i]));
+    }
+    fn(opaque, "cpsr", RISU_REG_FLAGS, &ri->cpsr, sizeof(ri->cpsr));
+    for (i = 0; i < 32; i++) {
+        /* Each d register is also a pair of s registers. */
+        snprintf(name, sizeof(name), "d%d", i);
+        fn(opaque, name, RISU_REG_VEC, &ri->fpregs[i], sizeof(ri->fpregs[i]));
+    }
+    fn(opaque, "fpscr", RISU_REG_FLAGS, &ri->fpscr, sizeof(ri->fpscr));
+}
+
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
 {
     int i;
@@ -78,6 +78,21 @@ void arch_init(void)
 {
 }
 
+int arch_sweep_count(void)
+{
+    return 0;
+}
+
+int arch_sweep_select(int i, char *name, size_t len)
+{
+    abort();
+}
+
+void arch_config(char *buf, size_t len)
+{
+    snprintf(buf, len, "xfeatures=%#" PRIx64, xfeatures);
+}
+
 int reginfo_size(struct reginfo *ri)
 {
     return sizeof(*ri);
@@ -234,6 +249,104 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
 #endif
 }
 
+/* reginfo_restore: write the compared state back into a ucontext */
+void reginfo_restore(struct reginfo *ri, ucontext_t *uc)
+{
+    int i, nvecregs;
+    struct _fpstate *fp;
+    struct _xstate *xs;
+    uint64_t features;
+
+    for (i = 0; i < NGREG; i++) {
+        switch (i) {
+        case REG_EFL:
+            uc->uc_mcontext.gregs[i] =
+                (uc->uc_mcontext.gregs[i] & ~0xd5) | ri->gregs[i];
+            break;
+        case REG_E(AX):
+        case REG_E(BX):
+        case REG_E(CX):
+        case REG_E(DX):
+        case REG_E(DI):
+        case REG_E(SI):
+        case REG_E(BP):
+#ifdef __x86_64__
+        case REG_R8:
+        case REG_R9:
+        case REG_R10:
+        case REG_R11:
+        case REG_R12:
+        case REG_R13:
+        case REG_R14:
+        case REG_R15:
+#endif
+            uc->uc_mcontext.gregs[i] = ri->gregs[i];
+            break;
+        }
+    }
+
+    fp = (struct _fpstate *)uc->uc_mcontext.fpregs;
+    if (fp == NULL) {
+        return;
+    }
+
+#ifdef __x86_64__
+    nvecregs = 16;
+#else
+    if (fp->magic != X86_FXSR_MAGIC) {
+        return;
+    }
+    nvecregs = 8;
+#endif
+
+    fp->mxcsr = ri->mxcsr;
+    for (i = 0; i < nvecregs; ++i) {
+#ifdef __x86_64__
+        memcpy(&fp->xmm_space[i * 4], &ri->vregs[i], 16);
+#else
+        memcpy(&fp->_xmm[i], &ri->vregs[i], 16);
+#endif
+    }
+
+    if (fp->sw_reserved.magic1 != FP_XSTATE_MAGIC1) {
+        return;
+    }
+    xs = (struct _xstate *)fp;
+    features = xfeatures & (XFEAT_AVX | XFEAT_AVX512);
+    /* Components in their init state are left out; bring them back. */
+    xs->xstate_hdr.xfeatures |= features;
+
+    if (features & XFEAT_AVX) {
+        void *buf = xsave_feature_buf(xs, XFEAT_AVX);
+        for (i = 0; i < nvecregs; ++i) {
+            memcpy(buf + 16 * i, &ri->vregs[i].q[2], 16);
+        }
+    }
+
+    if (features & XFEAT_AVX512_OPMASK) {
+        uint64_t *buf = xsave_feature_buf(xs, XFEAT_AVX512_OPMASK);
+        for (i = 0; i < 8; ++i) {
+            buf[i] = ri->kregs[i];
+        }
+    }
+
+    if (features & XFEAT_AVX512_ZMM_HI256) {
+        void *buf = xsave_feature_buf(xs, XFEAT_AVX512_ZMM_HI256);
+        for (i = 0; i < nvecregs; ++i) {
+            memcpy(buf + 32 * i, &ri->vregs[i].q[4], 32);
+        }
+    }
+
+#ifdef __x86_64__
+    if (features & XFEAT_AVX512_HI16_ZMM) {
+        void *buf = xsave_feature_buf(xs, XFEAT_AVX512_HI16_ZMM);
+        for (i = 0; i < 16; ++i) {
+            memcpy(buf + 64 * i, &ri->vregs[i + 16], 64);
+        }
+    }
+#endif
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns true if equal */
 bool reginfo_is_eq(struct reginfo *m, struct reginfo *a)
 {
@@ -347,6 +460,38 @@ void reginfo_dump(struct reginfo *ri, FILE *f)
     }
 }
 
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque)
+{
+    uint64_t features = ri->xfeatures;
+    int i, n, w;
+    char name[16];
+    char r;
+
+    for (i = 0; i < NGREG; i++) {
+        if (regname[i]) {
+            fn(opaque, regname[i],
+               i == REG_EFL ? RISU_REG_FLAGS : RISU_REG_INT,
+               &ri->gregs[i], sizeof(ri->gregs[i]));
+        }
+    }
+    fn(opaque, "mxcsr", RISU_REG_FLAGS, &ri->mxcsr, sizeof(ri->mxcsr));
+
+    n = get_nvecregs(features);
+    w = get_nvecquads(features);
+    r = get_vecletter(features);
+    for (i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "%cmm%d", r, i);
+        fn(opaque, name, RISU_REG_VEC, &ri->vregs[i], w * 8);
+    }
+
+    if (features & XFEAT_AVX512_OPMASK) {
+        for (i = 0; i < 8; i++) {
+            snprintf(name, sizeof(name), "k%d", i);
+            fn(opaque, name, RISU_REG_INT, &ri->kregs[i], sizeof(ri->kregs[i]));
+        }
+    }
+}
+
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
 {
     int i, j, n, w;
@@ -51,6 +51,21 @@ void arch_init(void)
 {
 }
 
+int arch_sweep_count(void)
+{
+    return 0;
+}
+
+int arch_sweep_select(int i, char *name, size_t len)
+{
+    abort();
+}
+
+void arch_config(char *buf, size_t len)
+{
+    snprintf(buf, len, "%s", "");
+}
+
 int reginfo_size(struct reginfo *ri)
 {
     return sizeof(*ri);
@@ -153,6 +168,51 @@ void reginfo_init(struct reginfo *ri, ucontext_t *context, void *siaddr)
     }
 }
 
+/* reginfo_restore: write the compared state back into a ucontext */
+void reginfo_restore(struct reginfo *ri, ucontext_t *context)
+{
+    int i;
+    struct ucontext *uc = (struct ucontext *)context;
+    struct extctx_layout extctx;
+
+    memset(&extctx, 0, sizeof(struct extctx_layout));
+
+    for (i = 1; i < 32; i++) {
+        if (i != 2) {
+            uc->uc_mcontext.sc_regs[i] = ri->regs[i];
+        }
+    }
+
+    parse_extcontext(&uc->uc_mcontext, &extctx);
+    if (extctx.lasx.addr) {
+        struct sctx_info *info = extctx.lasx.addr;
+        struct lasx_context *lasx_ctx = (struct lasx_context *)((char *)info +
+                                        sizeof(struct sctx_info));
+        memcpy(lasx_ctx->regs, ri->vregs, sizeof(ri->vregs));
+        lasx_ctx->fcsr = ri->fcsr;
+        lasx_ctx->fcc = ri->fcc;
+    } else if (extctx.lsx.addr) {
+        struct sctx_info *info = extctx.lsx.addr;
+        struct lsx_context *lsx_ctx = (struct lsx_context *)((char *)info +
+                                      sizeof(struct sctx_info));
+        for (i = 0; i < 32; i++) {
+            lsx_ctx->regs[2 * i] = ri->vregs[4 * i];
+            lsx_ctx->regs[2 * i + 1] = ri->vregs[4 * i + 1];
+        }
+        lsx_ctx->fcsr = ri->fcsr;
+        lsx_ctx->fcc = ri->fcc;
+    } else if (extctx.fpu.addr) {
+        struct sctx_info *info = extctx.fpu.addr;
+        struct fpu_context *fpu_ctx = (struct fpu_context *)((char *)info +
+                                      sizeof(struct sctx_info));
+        for (i = 0; i < 32; i++) {
+            fpu_ctx->regs[i] = ri->vregs[4 * i];
+        }
+        fpu_ctx->fcsr = ri->fcsr;
+        fpu_ctx->fcc = ri->fcc;
+    }
+}
+
 /* reginfo_is_eq: compare the reginfo structs */
 bool reginfo_is_eq(struct reginfo *r1, struct reginfo *r2)
 {
@@ -193,6 +253,28 @@ void reginfo_dump(struct reginfo *ri, FILE * f)
     }
 }
 
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque)
+{
+    char name[16];
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        snprintf(name, sizeof(name), "r%d", i);
+        fn(opaque, name, RISU_REG_INT, &ri->regs[i], sizeof(ri->regs[i]));
+    }
+    fn(opaque, "pc", RISU_REG_INT, &ri->pc, sizeof(ri->pc));
+    fn(opaque, "flags", RISU_REG_FLAGS, &ri->flags, sizeof(ri->flags));
+    fn(opaque, "fcc", RISU_REG_FLAGS, &ri->fcc, sizeof(ri->fcc));
+    fn(opaque, "fcsr", RISU_REG_FLAGS, &ri->fcsr, sizeof(ri->fcsr));
+
+    if (ri->vl == 256 || ri->vl == 128 || ri->vl == 64) {
+        for (i = 0; i < 32; i++) {
+            snprintf(name, sizeof(name), "vreg%d", i);
+            fn(opaque, name, RISU_REG_VEC, &ri->vregs[4 * i], ri->vl / 8);
+        }
+    }
+}
+
 /* reginfo_dump_mismatch: print mismatch details to a stream */
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE * f)
 {
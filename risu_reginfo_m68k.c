@@ -27,6 +27,21 @@ void arch_init(void)
 {
 }
 
+int arch_sweep_count(void)
+{
+    return 0;
+}
+
+int arch_sweep_select(int i, char *name, size_t len)
+{
+    abort();
+}
+
+void arch_config(char *buf, size_t len)
+{
+    snprintf(buf, len, "%s", "");
+}
+
 int reginfo_size(struct reginfo *ri)
 {
     return sizeof(*ri);
@@ -55,6 +70,27 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
     }
 }
 
+/* reginfo_restore: write the compared state back into a ucontext */
+void reginfo_restore(struct reginfo *ri, ucontext_t *uc)
+{
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        if (i != R_SP && i != R_A6) {
+            uc->uc_mcontext.gregs[i] = ri->gregs[i];
+        }
+    }
+    uc->uc_mcontext.gregs[R_PS] = ri->gregs[R_PS];
+
+    uc->uc_mcontext.fpregs.f_pcr = ri->fpregs.f_pcr;
+    uc->uc_mcontext.fpregs.f_psr = ri->fpregs.f_psr;
+    for (i = 0; i < 8; i++) {
+        memcpy(uc->uc_mcontext.fpregs.f_fpregs[i],
+               ri->fpregs.f_fpregs[i],
+               sizeof(ri->fpregs.f_fpregs[0]));
+    }
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns true if equal */
 bool reginfo_is_eq(struct reginfo *m, struct reginfo *a)
 {
@@ -116,6 +152,31 @@ void reginfo_dump(struct reginfo *ri, FILE *f)
     fprintf(f, "\n");
 }
 
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque)
+{
+    char name[16];
+    int i;
+
+    fn(opaque, "PC", RISU_REG_INT, &ri->gregs[R_PC], sizeof(ri->gregs[R_PC]));
+    fn(opaque, "PS", RISU_REG_FLAGS, &ri->gregs[R_PS],
+       sizeof(ri->gregs[R_PS]));
+    for (i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "D%d", i);
+        fn(opaque, name, RISU_REG_INT, &ri->gregs[i], sizeof(ri->gregs[i]));
+    }
+    for (i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "A%d", i);
+        fn(opaque, name, RISU_REG_INT, &ri->gregs[i + 8],
+           sizeof(ri->gregs[i + 8]));
+    }
+    for (i = 0; i < 8; i++) {
+        /* Extended precision: not classified as floats. */
+        snprintf(name, sizeof(name), "FP%d", i);
+        fn(opaque, name, RISU_REG_INT, ri->fpregs.f_fpregs[i],
+           sizeof(ri->fpregs.f_fpregs[i]));
+    }
+}
+
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
 {
     int i;
@@ -36,6 +36,21 @@ void arch_init(void)
 {
 }
 
+int arch_sweep_count(void)
+{
+    return 0;
+}
+
+int arch_sweep_select(int i, char *name, size_t len)
+{
+    abort();
+}
+
+void arch_config(char *buf, size_t len)
+{
+    snprintf(buf, len, "%s", "");
+}
+
 int reginfo_size(struct reginfo *ri)
 {
     return sizeof(*ri);
@@ -64,6 +79,28 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
     ri->vrregs.vrsave = uc->uc_mcontext.v_regs->vrsave;
 }
 
+/* reginfo_restore: write the compared state back into a ucontext */
+void reginfo_restore(struct reginfo *ri, ucontext_t *uc)
+{
+    int i;
+
+    for (i = 0; i < 32; i++) {
+        if (i != 1 && i != 13) {
+            uc->uc_mcontext.gp_regs[i] = ri->gregs[i];
+        }
+    }
+    uc->uc_mcontext.gp_regs[XER] = ri->gregs[XER];
+    uc->uc_mcontext.gp_regs[CCR] = ri->gregs[CCR];
+
+    memcpy(uc->uc_mcontext.fp_regs, ri->fpregs, 32 * sizeof(double));
+    uc->uc_mcontext.fp_regs[32] = ri->fpscr;
+
+    memcpy(uc->uc_mcontext.v_regs->vrregs, ri->vrregs.vrregs,
+           sizeof(ri->vrregs.vrregs[0]) * 32);
+    uc->uc_mcontext.v_regs->vscr = ri->vrregs.vscr;
+    uc->uc_mcontext.v_regs->vrsave = ri->vrregs.vrsave;
+}
+
 /* reginfo_is_eq: compare the reginfo structs, returns true if equal */
 bool reginfo_is_eq(struct reginfo *m, struct reginfo *a)
 {
@@ -103,6 +140,30 @@ void reginfo_dump(struct reginfo *ri, FILE * f)
     }
 }
 
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque)
+{
+    char name[16];
+    int i;
+
+    fn(opaque, "pc", RISU_REG_INT, &ri->nip, sizeof(ri->nip));
+    for (i = 0; i < 32; i++) {
+        snprintf(name, sizeof(name), "r%d", i);
+        fn(opaque, name, RISU_REG_INT, &ri->gregs[i], sizeof(ri->gregs[i]));
+    }
+    fn(opaque, "xer", RISU_REG_FLAGS, &ri->gregs[XER], sizeof(ri->gregs[XER]));
+    fn(opaque, "ccr", RISU_REG_FLAGS, &ri->gregs[CCR], sizeof(ri->gregs[CCR]));
+    for (i = 0; i < 32; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        fn(opaque, name, RISU_REG_FP, &ri->fpregs[i], sizeof(ri->fpregs[i]));
+    }
+    fn(opaque, "fpscr", RISU_REG_FLAGS, &ri->fpscr, sizeof(ri->fpscr));
+    for (i = 0; i < 32; i++) {
+        snprintf(name, sizeof(name), "vr%d", i);
+        fn(opaque, name, RISU_REG_VEC, ri->vrregs.vrregs[i],
+           sizeof(ri->vrregs.vrregs[i]));
+    }
+}
+
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
 {
     int i;
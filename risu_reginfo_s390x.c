@@ -33,6 +33,21 @@ void arch_init(void)
 {
 }
 
+int arch_sweep_count(void)
+{
+    return 0;
+}
+
+int arch_sweep_select(int i, char *name, size_t len)
+{
+    abort();
+}
+
+void arch_config(char *buf, size_t len)
+{
+    snprintf(buf, len, "%s", "");
+}
+
 int reginfo_size(struct reginfo *ri)
 {
     return sizeof(*ri);
@@ -73,6 +88,22 @@ void reginfo_init(struct reginfo *ri, ucontext_t *uc, void *siaddr)
     memcpy(ri->fprs, &uc->uc_mcontext.fpregs.fprs, sizeof(ri->fprs));
 }
 
+/* reginfo_restore: write the compared state back into a ucontext */
+void reginfo_restore(struct reginfo *ri, ucontext_t *uc)
+{
+    struct ucontext_extended *uce = (struct ucontext_extended *)uc;
+    const uint64_t cc_mask = 3ull << 44;
+
+    /* The condition code isn't compared, but later insns may use it. */
+    uce->uc_mcontext.regs.psw.mask =
+        (uce->uc_mcontext.regs.psw.mask & ~cc_mask) | (ri->psw_mask & cc_mask);
+
+    memcpy(uce->uc_mcontext.regs.gprs, ri->gprs, sizeof(ri->gprs));
+
+    uc->uc_mcontext.fpregs.fpc = ri->fpc;
+    memcpy(&uc->uc_mcontext.fpregs.fprs, ri->fprs, sizeof(ri->fprs));
+}
+
 /* reginfo_is_eq: compare the reginfo structs */
 bool reginfo_is_eq(struct reginfo *m, struct reginfo *a)
 {
@@ -105,6 +136,26 @@ void reginfo_dump(struct reginfo *ri, FILE * f)
     fprintf(f, "\tFPC: %8x\n\n", ri->fpc);
 }
 
+void reginfo_visit(struct reginfo *ri, reginfo_visit_fn *fn, void *opaque)
+{
+    char name[16];
+    int i;
+
+    fn(opaque, "PSW mask", RISU_REG_FLAGS, &ri->psw_mask,
+       sizeof(ri->psw_mask));
+    fn(opaque, "PC offset", RISU_REG_INT, &ri->pc_offset,
+       sizeof(ri->pc_offset));
+    for (i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "r%d", i);
+        fn(opaque, name, RISU_REG_INT, &ri->gprs[i], sizeof(ri->gprs[i]));
+    }
+    for (i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        fn(opaque, name, RISU_REG_FP, &ri->fprs[i], sizeof(ri->fprs[i]));
+    }
+    fn(opaque, "FPC", RISU_REG_FLAGS, &ri->fpc, sizeof(ri->fpc));
+}
+
 void reginfo_dump_mismatch(struct reginfo *m, struct reginfo *a, FILE *f)
 {
     int i;
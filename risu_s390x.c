@@ -21,6 +21,29 @@ void advance_pc(void *vuc)
      */
 }
 
+void set_ucontext_pc(void *vuc, uintptr_t pc)
+{
+    ucontext_t *uc = vuc;
+    uc->uc_mcontext.psw.addr = pc;
+}
+
+void set_ucontext_pc_after(void *vuc, uintptr_t pc)
+{
+    /*
+     * Unlike advance_pc() this can't rely on the kernel having moved
+     * the PSW address on: pc is the address of the risuop itself,
+     * which is 4 bytes long.
+     */
+    ucontext_t *uc = vuc;
+    uc->uc_mcontext.psw.addr = pc + 4;
+}
+
+uintptr_t get_ucontext_pc(void *vuc)
+{
+    ucontext_t *uc = vuc;
+    return uc->uc_mcontext.psw.addr;
+}
+
 void set_ucontext_paramreg(void *vuc, uint64_t value)
 {
     ucontext_t *uc = vuc;
@@ -46,6 +46,9 @@ my $test_thumb = 0; # should test code be Thumb mode?
 # Maximum alignment restriction permitted for a memory op.
 my $MAXALIGN = 64;
 
+# Register holding the running hash for --hash-regs (aarch64 only).
+my $HASH_REG = 28;
+
 # An instruction pattern as parsed from the config file turns into
 # a record like this:
 #   name          # name of the pattern
@@ -93,6 +96,8 @@ my $OP_TESTEND = 1;        # end of test, stop
 my $OP_SETMEMBLOCK = 2;    # r0 is address of memory block (8192 bytes)
 my $OP_GETMEMBLOCK = 3;    # add the address of memory block to r0
 my $OP_COMPAREMEM = 4;     # compare memory block
+my $OP_BENCHSTART = 5;     # start of benchmark loop (param is insn count)
+my $OP_BENCHLOOP = 6;      # end of benchmark loop
 
 sub write_thumb_risuop($)
 {
@@ -116,6 +121,7 @@ sub write_aarch64_risuop($)
 sub write_risuop($)
 {
     my ($op) = @_;
+    note_risuop($op);
     if ($is_thumb) {
         write_thumb_risuop($op);
     } elsif ($is_aarch64) {
@@ -352,6 +358,30 @@ sub write_mul_rrr($$$)
     write_madd_rrrr($rd, $rn, $rm, 31);
 }
 
+sub is_reg_field($$)
+{
+    my ($var, $mask) = @_;
+    return $var =~ /^r/ && $mask == 0x1f;
+}
+
+sub write_hash_fold($$)
+{
+    # Fold each register named by the fields of $insn into the hash,
+    # with eor xh, xn, xh, ror #13. A register number which means SP
+    # to the insn reads as XZR here, which is harmless.
+    my ($rec, $insn) = @_;
+    my %seen;
+
+    note_symbol("risu_hash");
+    for my $tuple (@{ $rec->{fields} }) {
+        my ($var, $pos, $mask) = @$tuple;
+        next if !is_reg_field($var, $mask);
+        my $reg = ($insn >> $pos) & $mask;
+        next if $seen{$reg}++;
+        insn32(0xcac00000 | ($HASH_REG << 16) | (13 << 10) | ($reg << 5) | $HASH_REG);
+    }
+}
+
 # write random fp value of passed precision (1=single, 2=double, 4=quad)
 sub write_random_fpreg_var($)
 {
@@ -363,22 +393,22 @@ sub write_random_fpreg_var($)
     }
 
     my ($low, $high);
-    my $r = rand(100);
-    if ($r < 5) {
+    my $class = pick_fp_class($precision);
+    if ($class eq "zero") {
         # +-0 (5%)
         $low = $high = 0;
         $high |= 0x80000000 if (rand() < 0.5);
-    } elsif ($r < 10) {
+    } elsif ($class eq "nan") {
         # NaN (5%)
         # (plus a tiny chance of generating +-Inf)
 	$randomize_low = 1;
         $high = rand(0xffffffff) | 0x7ff00000;
-    } elsif ($r < 15) {
+    } elsif ($class eq "inf") {
         # Infinity (5%)
         $low = 0;
         $high = 0x7ff00000;
         $high |= 0x80000000 if (rand() < 0.5);
-    } elsif ($r < 30) {
+    } elsif ($class eq "denormal") {
         # Denormalized number (15%)
         # (plus tiny chance of +-0)
 	$randomize_low = 1;
@@ -599,17 +629,18 @@ sub write_random_aarch64_regdata($$)
     }
 }
 
-sub write_random_register_data($$)
+sub write_random_register_data($$$)
 {
-    my ($fp_enabled, $sve_enabled) = @_;
+    my ($fp_enabled, $sve_enabled, $compare) = @_;
 
+    note_symbol("risu_reinit");
     if ($is_aarch64) {
         write_random_aarch64_regdata($fp_enabled, $sve_enabled);
     } else {
         write_random_arm_regdata($fp_enabled);
     }
 
-    write_risuop($OP_COMPARE);
+    write_risuop($OP_COMPARE) if $compare;
 }
 
 # put PC + offset into a register.
@@ -676,6 +707,7 @@ sub write_memblock_setup()
     # Write code which sets up the memory block for loads and stores.
     # We set r0 to point to a block of 8K length
     # of random data, aligned to the maximum desired alignment.
+    note_symbol("risu_memblock_setup");
     write_switch_to_arm();
 
     my $align = $MAXALIGN;
@@ -691,6 +723,7 @@ sub write_memblock_setup()
     write_risuop($OP_SETMEMBLOCK);           # insn 3
     write_jump_fwd($datalen);                # insn 4
 
+    note_symbol("risu_memblock");
     for (my $i = 0; $i < $datalen / 4; $i++) {
         insn32(rand(0xffffffff));
     }
@@ -961,7 +994,7 @@ sub gen_one_insn($$)
 
     INSN: while(1) {
         my ($forcecond, $rec) = @_;
-        my $insn = int(rand(0xffffffff));
+        my $insn = random_insn_bits($rec);
         my $insnname = $rec->{name};
         my $insnwidth = $rec->{width};
         my $fixedbits = $rec->{fixedbits};
@@ -969,15 +1002,17 @@ sub gen_one_insn($$)
         my $constraint = $rec->{blocks}{"constraints"};
         my $memblock = $rec->{blocks}{"memory"};
 
-        $insn &= ~$fixedbitmask;
-        $insn |= $fixedbits;
         for my $tuple (@{ $rec->{fields} }) {
             my ($var, $pos, $mask) = @$tuple;
             my $val = ($insn >> $pos) & $mask;
             # XXX (claudio) ARM-specific - maybe move to arm.risu?
             # Check constraints here:
-            # not allowed to use or modify sp or pc
-            if (!$is_aarch64) {
+            # not allowed to use or modify sp or pc, nor on aarch64
+            # the hash register when hashing
+            if ($is_aarch64) {
+                next INSN if (hash_regs() && is_reg_field($var, $mask)
+                              && $val == $HASH_REG);
+            } else {
                 next INSN if ($var =~ /^r/ && (($val == 13) || ($val == 15)));
                 # Some very arm-specific code to force the condition field
                 # to 'always' if requested.
@@ -989,7 +1024,7 @@ sub gen_one_insn($$)
                 }
             }
         }
-        if (defined $constraint) {
+        if (constraints_need_eval($rec)) {
             # user-specified constraint: evaluate in an environment
             # with variables set corresponding to the variable fields.
             my $v = eval_with_fields($insnname, $insn, $rec, "constraints", $constraint);
@@ -1005,10 +1040,12 @@ sub gen_one_insn($$)
 
         # OK, we got a good one
         $constraintfailures = 0;
+        note_insn_accepted($rec, $insn);
 
         my $basereg;
 
         if (defined $memblock) {
+            note_symbol("risu_memsetup");
             # This is a load or store. We simply evaluate the block,
             # which is expected to be a call to a function which emits
             # the code to set up the base register and returns the
@@ -1027,6 +1064,7 @@ sub gen_one_insn($$)
             }
         }
 
+        note_insn_offset($rec);
         if ($is_thumb) {
             # Since the encoding diagrams in the ARM ARM give 32 bit
             # Thumb instructions as low half | high half, we
@@ -1063,8 +1101,9 @@ sub gen_one_insn($$)
                 write_sub_rrr($basereg, $basereg, 0);
                 write_mov_ri(0, 0);
             }
-            write_risuop($OP_COMPAREMEM);
+            write_risuop($OP_COMPAREMEM) if !defer_memcompare();
         }
+        write_hash_fold($rec, $insn) if hash_regs() == 1;
         return;
     }
 }
@@ -1090,6 +1129,9 @@ sub write_test_code($$$$$$$$)
     my $condprob = $params->{ 'condprob' };
     my $fpscr = $params->{ 'fpscr' };
     my $numinsns = $params->{ 'numinsns' };
+    my $seed = $params->{ 'seed' };
+    my $jobs = $params->{ 'jobs' };
+    my $bench = $params->{ 'bench' };
     my $fp_enabled = $params->{ 'fp_enabled' };
     my $sve_enabled = $params->{ 'sve_enabled' };
     my $outfile = $params->{ 'outfile' };
@@ -1103,8 +1145,7 @@ sub write_test_code($$$$$$$$)
     # probability of forcing insn to unconditional
     $condprob = 1 - $condprob;
 
-    # TODO better random number generator?
-    srand(0);
+    set_random_seed($seed);
 
     print "Generating code using patterns: @keys...\n";
     progress_start(78, $numinsns);
@@ -1116,23 +1157,45 @@ sub write_test_code($$$$$$$$)
     if (grep { defined($insn_details{$_}->{blocks}->{"memory"}) } @keys) {
         write_memblock_setup();
     }
+    if ($bench) {
+        # A benchmark image runs the register reinit and the generated
+        # insns in a loop, which risu --bench times. The reinit leaves
+        # out its compare, so that nothing inside the loop traps.
+        write_switch_to_arm();
+        write_mov_ri(0, $numinsns);
+        write_risuop($OP_BENCHSTART);
+    }
     # memblock setup doesn't clean its registers, so this must come afterwards.
-    write_random_register_data($fp_enabled, $sve_enabled);
+    write_random_register_data($fp_enabled, $sve_enabled, !$bench);
     write_switch_to_test_mode();
 
-    for my $i (1..$numinsns) {
-        my $insn_enc = $keys[int rand (@keys)];
+    # Each chunk of 100 insns ends a block and does the periodic register
+    # reinit, which leaves us in the same state as we started the chunk in.
+    write_insn_chunks($numinsns, 100, $jobs, sub {
+        my ($i) = @_;
+        my $insn_enc = pick_insn_key(\@keys, \%insn_details);
         #dump_insn_details($insn_enc, $insn_details{$insn_enc});
         my $forcecond = (rand() < $condprob) ? 1 : 0;
         gen_one_insn($forcecond, $insn_details{$insn_enc});
-        write_risuop($OP_COMPARE);
+        return if $bench;
+        # A replay image compares after every insn, but still asks
+        # insn_ends_block() so as to draw the same random numbers.
+        if (insn_ends_block(($i % 100) == 0 || $i == $numinsns)
+            || hash_regs() == 2) {
+            write_risuop($OP_COMPAREMEM) if take_deferred_memcompare();
+            write_risuop($OP_COMPARE);
+        }
         # Rewrite the registers periodically. This avoids the tendency
         # for the VFP registers to decay to NaNs and zeroes.
         if ($periodic_reg_random && ($i % 100) == 0) {
-            write_random_register_data($fp_enabled, $sve_enabled);
+            write_random_register_data($fp_enabled, $sve_enabled, 1);
             write_switch_to_test_mode();
         }
-        progress_update($i);
+    });
+    if ($bench) {
+        write_switch_to_arm();
+        write_risuop($OP_BENCHLOOP);
+        write_risuop($OP_COMPARE);
     }
     write_risuop($OP_TESTEND);
     progress_end();
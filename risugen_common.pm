@@ -18,6 +18,9 @@ package risugen_common;
 
 use strict;
 use warnings;
+use IO::Handle;
+use POSIX ();
+use Fcntl qw(:flock);
 
 BEGIN {
     require Exporter;
@@ -26,12 +29,33 @@ BEGIN {
     our @EXPORT = qw(open_bin close_bin set_endian insn32 insn16 $bytecount
                    progress_start progress_update progress_end
                    eval_with_fields is_pow_of_2 sextract ctz
-                   dump_insn_details);
+                   dump_insn_details
+                   analyse_constraints random_insn_bits constraints_need_eval
+                   note_insn_accepted constraint_stats_report
+                   set_random_seed write_insn_chunks
+                   enable_coverage load_coverage save_coverage
+                   coverage_report pick_insn_key pick_fp_class
+                   set_block_size insn_ends_block defer_memcompare
+                   take_deferred_memcompare set_hash_regs hash_regs
+                   enable_insn_map note_insn_offset
+                   enable_elf note_symbol note_risuop);
 }
 
 our $bytecount;
 
 my $bigendian = 0;
+my $binname;
+
+# With --map we record the offset of each generated insn, and write
+# them to "$binname.map" for risu --profile. With --elf the output is
+# an ELF object with a symbol for each generated insn and for each
+# piece of risugen's own code (register setup, memblock, risuops).
+my $map_arch;
+my $elf_arch;
+my @insn_map;           # [ offset, name, size (0 for risugen's own code) ]
+
+my @risuop_names = qw(compare testend setmemblock getmemblock comparemem
+                      benchstart benchloop);
 
 # Set the endianness when insn32() and insn16() write to the output
 # (default is little endian, 0).
@@ -44,12 +68,172 @@ sub open_bin
 {
     my ($fname) = @_;
     open(BIN, ">", $fname) or die "can't open %fname: $!";
+    binmode(BIN);
+    $binname = $fname;
     $bytecount = 0;
+    @insn_map = ();
+    note_symbol("risu_setup");
+}
+
+sub write_map($$)
+{
+    my ($fname, $header) = @_;
+    open(my $fh, ">", $fname) or die "can't open $fname: $!";
+    print $fh $header;
+    for my $e (@insn_map) {
+        printf $fh "0x%08x\t%d\t%s\n", $e->[0], $e->[2], $e->[1] if $e->[2];
+    }
+    close($fh) or die "can't close $fname: $!";
+}
+
+# ELF header fields per risugen mode: machine, 64 bit class, e_flags
+# (ppc64 flags are for big, little endian).
+my %elf_machines = (
+    'arm' => [ 40, 0, 0x05000000 ],
+    'arm.thumb' => [ 40, 0, 0x05000000 ],
+    'arm.aarch64' => [ 183, 1, 0 ],
+    'loongarch64' => [ 258, 1, 0x43 ],
+    'm68k' => [ 4, 0, 0 ],
+    'ppc64' => [ 21, 1, [ 1, 2 ] ],
+    's390x' => [ 22, 1, 0 ],
+);
+
+sub elf_symbol_name($)
+{
+    my ($name) = @_;
+    $name =~ s/\s+/_/g;
+    return $name;
+}
+
+sub write_elf($$)
+{
+    # Wrap the code in an ELF relocatable object: a .text section
+    # holding the image, and a local function symbol for each entry
+    # in @insn_map, which runs up to the next one.
+    my ($fname, $code) = @_;
+    my ($machine, $is64, $flags) = @{ $elf_machines{$elf_arch} };
+    my $e = $bigendian ? ">" : "<";
+    my $addr = $is64 ? "Q$e" : "L$e";
+    my ($ehsize, $shentsize, $symentsize) = $is64 ? (64, 64, 24)
+                                                  : (52, 40, 16);
+    $flags = $flags->[$bigendian ? 0 : 1] if ref $flags;
+
+    my $strtab = "\0";
+    my $symtab = "\0" x $symentsize;
+    my $nsyms = 1;
+    my @syms = sort { $a->[0] <=> $b->[0] } @insn_map;
+    for my $i (0..$#syms) {
+        my ($off, $name) = @{ $syms[$i] };
+        my $end = $i < $#syms ? $syms[$i + 1][0] : length($code);
+        next if $end == $off;
+        my $nameoff = length($strtab);
+        $strtab .= elf_symbol_name($name) . "\0";
+        # STB_LOCAL, STT_FUNC, section 1 (.text)
+        if ($is64) {
+            $symtab .= pack("L${e}CCS${e}Q${e}Q${e}", $nameoff, 2, 0, 1,
+                            $off, $end - $off);
+        } else {
+            $symtab .= pack("L${e}L${e}L${e}CCS${e}", $nameoff, $off,
+                            $end - $off, 2, 0, 1);
+        }
+        $nsyms++;
+    }
+
+    my $shstrtab = "\0.text\0.symtab\0.strtab\0.shstrtab\0";
+    my @sections;               # [ name, type, flags, data, link, info, align, entsize ]
+    push @sections, [ 1, 1, 6, $code, 0, 0, 16, 0 ];    # PROGBITS, AX
+    push @sections, [ 7, 2, 0, $symtab, 3, $nsyms, 8, $symentsize ];
+    push @sections, [ 15, 3, 0, $strtab, 0, 0, 1, 0 ];
+    push @sections, [ 23, 3, 0, $shstrtab, 0, 0, 1, 0 ];
+
+    my $body = "";
+    my @offsets;
+    for my $sec (@sections) {
+        my $off = $ehsize + length($body);
+        my $pad = (-$off) % $sec->[6];
+        $body .= "\0" x $pad;
+        push @offsets, $off + $pad;
+        $body .= $sec->[3];
+    }
+    $body .= "\0" x ((-($ehsize + length($body))) % 8);
+    my $shoff = $ehsize + length($body);
+
+    my $shdrs = "\0" x $shentsize;
+    for my $i (0..$#sections) {
+        my ($name, $type, $shflags, $data, $link, $info, $align, $entsize) =
+            @{ $sections[$i] };
+        if ($is64) {
+            $shdrs .= pack("L${e}L${e}Q${e}Q${e}Q${e}Q${e}L${e}L${e}Q${e}Q${e}",
+                           $name, $type, $shflags, 0, $offsets[$i],
+                           length($data), $link, $info, $align, $entsize);
+        } else {
+            $shdrs .= pack("L${e}" x 10, $name, $type, $shflags, 0,
+                           $offsets[$i], length($data), $link, $info,
+                           $align, $entsize);
+        }
+    }
+
+    my $ident = pack("a4CCCCa8", "\x7fELF", $is64 ? 2 : 1,
+                     $bigendian ? 2 : 1, 1, 0, "");
+    # ET_REL, no entry point or program headers
+    my $ehdr = $ident . pack("S${e}S${e}L${e}${addr}${addr}${addr}L${e}S${e}S${e}S${e}S${e}S${e}S${e}",
+                             1, $machine, 1, 0, 0, $shoff, $flags,
+                             $ehsize, 0, 0, $shentsize,
+                             scalar(@sections) + 1, scalar(@sections));
+
+    open(my $fh, ">", $fname) or die "can't open $fname: $!";
+    binmode($fh);
+    print $fh $ehdr, $body, $shdrs;
+    close($fh) or die "can't close $fname: $!";
 }
 
 sub close_bin
 {
     close(BIN) or die "can't close output file: $!";
+    write_map("$binname.map", "# risugen insn map for $binname\n" .
+              "# mode $map_arch " . ($bigendian ? "big" : "little") . "\n")
+        if defined $map_arch;
+    if (defined $elf_arch) {
+        my $code;
+        open(my $fh, "<", $binname) or die "can't open $binname: $!";
+        binmode($fh);
+        { local $/; $code = <$fh>; }
+        close($fh);
+        write_elf($binname, $code);
+    }
+}
+
+sub enable_insn_map($)
+{
+    ($map_arch) = @_;
+}
+
+sub enable_elf($)
+{
+    my ($arch) = @_;
+    die "--elf is not supported for $arch\n" if !exists $elf_machines{$arch};
+    $elf_arch = $arch;
+}
+
+sub note_symbol($)
+{
+    # Start a symbol for risugen's own code at the current offset.
+    my ($name) = @_;
+    push @insn_map, [ $bytecount, $name, 0 ] if defined $elf_arch;
+}
+
+sub note_risuop($)
+{
+    my ($op) = @_;
+    note_symbol("risu_op_" . ($risuop_names[$op] // $op));
+}
+
+sub note_insn_offset($)
+{
+    # Call just before writing the insn itself, after any setup.
+    my ($rec) = @_;
+    push @insn_map, [ $bytecount, $rec->{name}, $rec->{width} / 8 ]
+        if defined $map_arch || defined $elf_arch;
 }
 
 sub insn32($)
@@ -70,6 +254,7 @@ sub insn16($)
 my $lastprog;
 my $proglen;
 my $progmax;
+my $progquiet = 0;
 
 sub progress_start($$)
 {
@@ -84,6 +269,7 @@ sub progress_update($)
 {
     # update the progress bar with current progress
     my ($done) = @_;
+    return if $progquiet;
     my $barlen = int($proglen * $done / $progmax);
     if ($barlen != $lastprog) {
         $lastprog = $barlen;
@@ -97,6 +283,238 @@ sub progress_end()
     $| = 0;
 }
 
+# Random number streams.
+#
+# The instruction stream is generated in chunks, each of which
+# draws from its own random number stream. The seed for a stream is
+# a hash of the user's seed and the chunk number, so any chunk can be
+# generated without first generating the ones before it, which is
+# what lets --jobs produce the same output as a serial run.
+# Stream 0 is used for everything before the first chunk.
+
+my $seed = 0;
+
+sub mul32($$)
+{
+    # 32x32->32 bit multiply which stays exact in perl arithmetic
+    my ($a, $b) = @_;
+    my $lo = ($a & 0xffff) * $b;
+    my $hi = (($a >> 16) * $b) & 0xffff;
+    return ($lo + ($hi << 16)) & 0xffffffff;
+}
+
+sub mix32($)
+{
+    # murmur3 finalizer
+    my ($h) = @_;
+    $h ^= $h >> 16;
+    $h = mul32($h, 0x85ebca6b);
+    $h ^= $h >> 13;
+    $h = mul32($h, 0xc2b2ae35);
+    $h ^= $h >> 16;
+    return $h;
+}
+
+sub seed_stream($)
+{
+    my ($stream) = @_;
+    srand(mix32(mix32($seed & 0xffffffff) ^ mul32($stream, 0x9e3779b9)));
+}
+
+sub set_random_seed($)
+{
+    ($seed) = @_;
+    seed_stream(0);
+}
+
+sub write_chunk_range($$$$$)
+{
+    # Generate insns $first..$last, reseeding at each chunk boundary.
+    my ($first, $last, $numinsns, $chunklen, $genfn) = @_;
+    for my $i ($first..$last) {
+        if (($i - 1) % $chunklen == 0) {
+            seed_stream(int(($i - 1) / $chunklen) + 1);
+        }
+        $genfn->($i);
+        progress_update($i);
+    }
+}
+
+sub write_insn_chunks($$$$)
+{
+    # Call $genfn->($i) for each of insns 1..$numinsns.
+    # Each chunk of $chunklen insns must leave the generator in the
+    # same state as it found it (for instance by finishing with a
+    # register reinitialisation), so that chunks can be generated
+    # independently. With $jobs > 1 the chunks are shared out among
+    # that many worker processes and the results concatenated.
+    my ($numinsns, $chunklen, $jobs, $genfn) = @_;
+    my $nchunks = int(($numinsns + $chunklen - 1) / $chunklen);
+
+    if ($jobs <= 1 || $nchunks <= 1) {
+        write_chunk_range(1, $numinsns, $numinsns, $chunklen, $genfn);
+        return;
+    }
+    $jobs = $nchunks if $jobs > $nchunks;
+
+    # Anything still buffered would otherwise be written by every child.
+    BIN->flush();
+    STDOUT->flush();
+
+    my @workers;
+    my $done = 0;
+    for my $w (0..$jobs - 1) {
+        my $c0 = int($nchunks * $w / $jobs);
+        my $c1 = int($nchunks * ($w + 1) / $jobs);
+        my $first = $c0 * $chunklen + 1;
+        my $last = $c1 * $chunklen;
+        $last = $numinsns if $last > $numinsns;
+        my $part = "$binname.part$w";
+
+        my $pid = fork();
+        die "fork failed: $!" if !defined $pid;
+        if ($pid == 0) {
+            my $start = $bytecount;
+            open(BIN, ">", $part) or die "can't open $part: $!";
+            binmode(BIN);
+            # Only the alignment of $bytecount matters, and every chunk
+            # starts at the same alignment as the first.
+            $bytecount = $start;
+            $progquiet = 1;
+            @insn_map = ();
+            write_chunk_range($first, $last, $numinsns, $chunklen, $genfn);
+            close(BIN) or POSIX::_exit(1);
+            if (@insn_map) {
+                # Offsets in the part map are relative to its start.
+                open(my $mfh, ">", "$part.map") or POSIX::_exit(1);
+                printf $mfh "%d\t%d\t%s\n", $_->[0] - $start, $_->[2], $_->[1]
+                    for @insn_map;
+                close($mfh) or POSIX::_exit(1);
+            }
+            POSIX::_exit(0);
+        }
+        push @workers, [ $pid, $part, $last - $first + 1 ];
+    }
+
+    my $failed = 0;
+    for my $wk (@workers) {
+        my ($pid, $part, $count) = @$wk;
+        waitpid($pid, 0);
+        if ($? != 0) {
+            $failed = 1;
+            next;
+        }
+        my $data;
+        open(my $fh, "<", $part) or die "can't open $part: $!";
+        binmode($fh);
+        { local $/; $data = <$fh>; }
+        close($fh);
+        print BIN $data;
+        if (open(my $mfh, "<", "$part.map")) {
+            while (<$mfh>) {
+                my ($off, $size, $name) = /^(\d+)\t(\d+)\t(.*)$/ or next;
+                push @insn_map, [ $bytecount + $off, $name, $size ];
+            }
+            close($mfh);
+        }
+        $bytecount += length($data);
+        $done += $count;
+        progress_update($done);
+    }
+    unlink map { $_->[1] } @workers;
+    unlink grep { -e } map { "$_->[1].map" } @workers;
+    die "risugen worker failed\n" if $failed;
+}
+
+# Instruction blocks.
+#
+# By default every generated instruction is followed by a register
+# compare. With a block size of K (or a range K1-K2, picked afresh
+# for each block) K instructions are generated between compares,
+# so that they are translated and optimised together by the model
+# under test. Memory compares are likewise deferred to the end of
+# the block; the base register fixups still follow each access.
+
+my $block_min = 1;
+my $block_max = 1;
+my $block_left = 0;
+my $block_memcompare = 0;
+
+sub set_block_size($)
+{
+    my ($spec) = @_;
+    if ($spec =~ /^(\d+)$/) {
+        ($block_min, $block_max) = ($1, $1);
+    } elsif ($spec =~ /^(\d+)-(\d+)$/) {
+        ($block_min, $block_max) = ($1, $2);
+    } else {
+        die "invalid block size \"$spec\" (expected K or K1-K2)\n";
+    }
+    if ($block_min < 1 || $block_max < $block_min) {
+        die "invalid block size \"$spec\"\n";
+    }
+}
+
+sub insn_ends_block($)
+{
+    # Called after each generated insn: return true if it should be
+    # followed by a compare. $force ends the block early, which the
+    # caller must do at every chunk boundary so that blocks never
+    # span chunks.
+    my ($force) = @_;
+    return 1 if $block_max == 1;
+    if ($block_left == 0) {
+        $block_left = $block_min + int(rand($block_max - $block_min + 1));
+    }
+    $block_left--;
+    if ($force || $block_left == 0) {
+        $block_left = 0;
+        return 1;
+    }
+    return 0;
+}
+
+sub defer_memcompare()
+{
+    # Return true if the memory compare following an access should
+    # be left to the end of the block.
+    return 0 if $block_max == 1;
+    $block_memcompare = 1;
+    return 1;
+}
+
+sub take_deferred_memcompare()
+{
+    my $r = $block_memcompare;
+    $block_memcompare = 0;
+    return $r;
+}
+
+# Register hashing.
+#
+# In hash mode (--hash-regs) the CPU module follows each generated
+# insn with code folding the registers it names into a running hash,
+# kept in a register which the generated insns are not allowed to
+# use. The compare at the end of each block then checks the hash with
+# the rest of the registers, so that a wrong value which was
+# overwritten again before the end of the block is still caught.
+# Replay mode generates the same insns with a compare after each
+# one and no hashing, for finding which insn it was.
+
+my $hash_mode = 0;
+
+sub set_hash_regs($)
+{
+    my ($mode) = @_;
+    $hash_mode = $mode;
+}
+
+sub hash_regs()
+{
+    # 0 when off, 1 to hash, 2 to replay.
+    return $hash_mode;
+}
+
 sub eval_with_fields($$$$$) {
     # Evaluate the given block in an environment with Perl variables
     # set corresponding to the variable fields for the insn.
@@ -130,6 +548,474 @@ sub eval_with_fields($$$$$) {
     return $v;
 }
 
+# Constraint analysis for field sampling.
+#
+# Rather than drawing a full random word and retrying until the
+# constraints block is satisfied, we look for conjuncts of the block
+# which only mention a single variable field (eg "$rn != 31",
+# "$size < 2", "!($imm & 7)", "$op == 1 || $op == 3") and work out
+# the set of values each such field may take. The field is then
+# sampled directly from that set. Anything we don't understand is
+# left for the normal eval-and-retry loop in the backends.
+
+# Fields wider than this are never enumerated.
+my $MAX_DOMAIN_BITS = 16;
+
+sub split_conjuncts($)
+{
+    # Split an expression at top-level "&&", returning undef
+    # if the parentheses don't balance, or if it has to be split
+    # but something at the top level binds more loosely than "&&"
+    # ("||", "?:", ",", or the low precedence "and", "or", "xor"
+    # and "not"), since then the parts need not all hold.
+    my ($expr) = @_;
+    my @parts;
+    my $depth = 0;
+    my $cur = '';
+    my $top = '';
+    my $loose = 0;
+    for (my $i = 0; $i < length($expr); $i++) {
+        my $c = substr($expr, $i, 1);
+        if ($c eq '(') {
+            $depth++;
+        } elsif ($c eq ')') {
+            return undef if --$depth < 0;
+        } elsif ($depth == 0) {
+            my $c2 = substr($expr, $i, 2);
+            $loose = 1 if $c2 eq '||' || $c eq '?' || $c eq ',';
+            if ($c2 eq '&&') {
+                push @parts, $cur;
+                $cur = '';
+                $top .= ' ';
+                $i++;
+                next;
+            }
+            $top .= $c;
+        }
+        $cur .= $c;
+    }
+    return undef if $depth != 0;
+    $loose = 1 if $top =~ /(?<![\$\w])(and|or|xor|not)\b/;
+    return undef if $loose && @parts;
+    push @parts, $cur;
+    return @parts;
+}
+
+sub single_field_predicate($$)
+{
+    # If $expr is a side-effect free expression over exactly one of
+    # the fields in %$widths, return (fieldname, compiled predicate).
+    my ($expr, $widths) = @_;
+    my %vars = map { $_ => 1 } ($expr =~ /\$([A-Za-z][A-Za-z0-9]*)/g);
+    return () if scalar(keys %vars) != 1;
+    my ($var) = keys %vars;
+    return () if !defined $widths->{$var} || $widths->{$var} > $MAX_DOMAIN_BITS;
+
+    # Only numbers, operators and parentheses may remain.
+    my $rest = $expr;
+    $rest =~ s/\$$var\b//g;
+    $rest =~ s/\b(0x[0-9a-fA-F]+|0b[01]+|[0-9]+)\b//g;
+    return () if $rest !~ /^[\s()!&|<>=%+\-*^~]*$/;
+    # ...and no assignments hidden among the operators.
+    return () if $rest =~ /(?<![=!<>])=(?!=)|[+\-*%&|^]=|\+\+|--/;
+
+    my $pred = eval "sub { my (\$$var) = \@_; $expr }";
+    return () if $@ || !defined $pred;
+    return ($var, $pred);
+}
+
+sub analyse_constraints($)
+{
+    # Fill in $rec->{sampler} with the allowed value lists for any
+    # fields we could analyse, and whether the constraints block
+    # still needs to be evaluated after sampling.
+    my ($rec) = @_;
+    my %widths;
+    my %domains;
+    my $residual = 0;
+
+    for my $tuple (@{ $rec->{fields} }) {
+        my ($var, $pos, $mask) = @$tuple;
+        $widths{$var} = length(sprintf("%b", $mask));
+    }
+
+    my $block = $rec->{blocks}{"constraints"};
+    if (defined $block) {
+        my $expr = $block;
+        $expr =~ s/^\s*\{//;
+        $expr =~ s/\}\s*$//;
+        $expr =~ s/;\s*$//;
+        my @conj = ($expr =~ /;/) ? () : split_conjuncts($expr);
+        if (!@conj || !defined $conj[0]) {
+            @conj = ();
+            $residual = 1;
+        }
+        for my $c (@conj) {
+            my ($var, $pred) = single_field_predicate($c, \%widths);
+            if (!defined $var) {
+                $residual = 1;
+                next;
+            }
+            my $vals = $domains{$var} // [ 0 .. (1 << $widths{$var}) - 1 ];
+            $domains{$var} = [ grep { $pred->($_) } @$vals ];
+        }
+    }
+
+    # A field whose domain is the whole range gains us nothing.
+    for my $var (keys %domains) {
+        delete $domains{$var} if @{ $domains{$var} } == (1 << $widths{$var});
+        if (defined $domains{$var} && !@{ $domains{$var} }) {
+            # Unsatisfiable; let the retry loop report it.
+            delete $domains{$var};
+            $residual = 1;
+        }
+    }
+
+    $rec->{sampler} = {
+        domains => \%domains,
+        residual => $residual,
+        attempts => 0,
+        accepted => 0,
+    };
+}
+
+# Coverage guided generation.
+#
+# With coverage enabled we keep a count of how often each coverage
+# cell has been hit, and bias generation towards the cells which
+# have not. The cells are a bucket of the value of each variable
+# field of each pattern, and the class of each random FP value
+# written by the register initialisation. Counts can be carried
+# over from earlier runs with load_coverage()/save_coverage().
+# With coverage disabled none of this consumes random numbers, so
+# the output is unchanged.
+
+my $coverage_on = 0;
+my %coverage;           # cell -> hits, including loaded counts
+my %coverage_new;       # cell -> hits in this run only
+
+# Classes written by write_random_fpreg_var(), and their share of
+# the unguided distribution (out of 100).
+my @fp_classes = ( [ "zero", 5 ], [ "nan", 5 ], [ "inf", 5 ],
+                   [ "denormal", 15 ], [ "normal", 70 ] );
+
+sub enable_coverage()
+{
+    $coverage_on = 1;
+}
+
+sub field_bucket($$)
+{
+    # Bucket a field value: narrow fields by value, wider ones by
+    # the boundary values that tend to find bugs.
+    my ($val, $width) = @_;
+    return $val if $width <= 3;
+    my $ones = (1 << $width) - 1;
+    return "zero" if $val == 0;
+    return "one" if $val == 1;
+    return "ones" if $val == $ones;
+    return "msb" if $val & (1 << ($width - 1));
+    return "other";
+}
+
+sub bucket_value($$)
+{
+    # Return a random value of $width bits which falls in $bucket.
+    my ($bucket, $width) = @_;
+    return $bucket if $width <= 3;
+    my $ones = (1 << $width) - 1;
+    my $msb = 1 << ($width - 1);
+    return 0 if $bucket eq "zero";
+    return 1 if $bucket eq "one";
+    return $ones if $bucket eq "ones";
+    if ($bucket eq "msb") {
+        my $v = $msb | int(rand($msb));
+        return $v == $ones ? $ones - 1 : $v;
+    }
+    my $v = int(rand($msb));
+    return $v < 2 ? 2 : $v;
+}
+
+sub coverage_fields($)
+{
+    # Return (and cache) the list of [ var, pos, mask, [ buckets ] ]
+    # coverage cells for a pattern. Fields whose values are sampled
+    # from a constrained domain only get the buckets of that domain.
+    my ($rec) = @_;
+    return $rec->{covfields} if defined $rec->{covfields};
+    my $domains = $rec->{sampler}{domains} // {};
+    my @cf;
+    for my $tuple (@{ $rec->{fields} }) {
+        my ($var, $pos, $mask) = @$tuple;
+        my $width = length(sprintf("%b", $mask));
+        my @buckets;
+        if (defined $domains->{$var}) {
+            my %seen;
+            @buckets = grep { !$seen{$_}++ }
+                       map { field_bucket($_, $width) } @{ $domains->{$var} };
+        } elsif ($width <= 3) {
+            @buckets = (0 .. $mask);
+        } else {
+            @buckets = qw(zero one ones msb other);
+        }
+        push @cf, [ $var, $pos, $mask, \@buckets ];
+    }
+    $rec->{covfields} = \@cf;
+    return \@cf;
+}
+
+sub uncovered_cells($)
+{
+    # Number of coverage cells of the pattern not yet hit.
+    my ($rec) = @_;
+    my $n = 0;
+    for my $f (@{ coverage_fields($rec) }) {
+        my ($var, $pos, $mask, $buckets) = @$f;
+        $n += grep { !$coverage{"$rec->{name}\t$var=$_"} } @$buckets;
+    }
+    return $n;
+}
+
+# Selection weights of the patterns being generated: 1 plus the
+# number of uncovered cells, kept up to date as cells are hit.
+my $pick_keys;
+my %pick_index;
+my @pick_weights;
+my $pick_total;
+
+sub update_pick_weight($)
+{
+    my ($rec) = @_;
+    my $i = $pick_index{$rec->{name}};
+    return if !defined $i;
+    my $w = 1 + uncovered_cells($rec);
+    $pick_total += $w - $pick_weights[$i];
+    $pick_weights[$i] = $w;
+}
+
+sub pick_insn_key($$)
+{
+    # Choose the next pattern to generate. Unguided this is uniform;
+    # guided, patterns are weighted by their number of uncovered cells.
+    my ($keys, $details) = @_;
+    return $keys->[int rand(@$keys)] if !$coverage_on;
+
+    if (!defined $pick_keys || $pick_keys != $keys) {
+        $pick_keys = $keys;
+        %pick_index = ();
+        @pick_weights = ();
+        $pick_total = 0;
+        for my $i (0 .. $#$keys) {
+            my $rec = $details->{$keys->[$i]};
+            analyse_constraints($rec) if !defined $rec->{sampler};
+            $pick_index{$keys->[$i]} = $i;
+            push @pick_weights, 0;
+            update_pick_weight($rec);
+        }
+    }
+    my $r = rand($pick_total);
+    for my $i (0 .. $#pick_weights) {
+        $r -= $pick_weights[$i];
+        return $keys->[$i] if $r < 0;
+    }
+    return $keys->[-1];
+}
+
+sub guide_insn_fields($$)
+{
+    # Steer each field with uncovered buckets into one of them, half
+    # of the time. Constraints are still checked by the caller, so
+    # a bucket the constraints forbid merely costs a retry.
+    my ($rec, $insn) = @_;
+    for my $f (@{ coverage_fields($rec) }) {
+        my ($var, $pos, $mask, $buckets) = @$f;
+        my @todo = grep { !$coverage{"$rec->{name}\t$var=$_"} } @$buckets;
+        next if !@todo || rand() < 0.5;
+        my $bucket = $todo[int rand(@todo)];
+        my $width = length(sprintf("%b", $mask));
+        my $val;
+        my $dom = $rec->{sampler}{domains}{$var};
+        if (defined $dom) {
+            my @vals = grep { field_bucket($_, $width) eq $bucket } @$dom;
+            $val = $vals[int rand(@vals)];
+        } else {
+            $val = bucket_value($bucket, $width);
+        }
+        $insn &= ~($mask << $pos);
+        $insn |= $val << $pos;
+    }
+    return $insn;
+}
+
+sub note_coverage($)
+{
+    # Returns true if this is the first hit of the cell.
+    my ($cell) = @_;
+    $coverage_new{$cell}++;
+    return !$coverage{$cell}++;
+}
+
+sub note_insn_coverage($$)
+{
+    my ($rec, $insn) = @_;
+    for my $f (@{ coverage_fields($rec) }) {
+        my ($var, $pos, $mask) = @$f;
+        my $width = length(sprintf("%b", $mask));
+        my $val = ($insn >> $pos) & $mask;
+        my $new = note_coverage("$rec->{name}\t$var=" . field_bucket($val, $width));
+        update_pick_weight($rec) if $new;
+    }
+}
+
+sub pick_fp_class($)
+{
+    # Choose the class of the next random FP value of the given
+    # precision, favouring classes not yet generated.
+    my ($precision) = @_;
+    my $class;
+    if ($coverage_on) {
+        my @todo = grep { !$coverage{"fp$precision\t$_->[0]"} } @fp_classes;
+        $class = $todo[int rand(@todo)][0] if @todo && rand() < 0.5;
+    }
+    if (!defined $class) {
+        my $r = rand(100);
+        for my $c (@fp_classes) {
+            $class = $c->[0];
+            last if ($r -= $c->[1]) < 0;
+        }
+    }
+    note_coverage("fp$precision\t$class") if $coverage_on;
+    return $class;
+}
+
+sub read_coverage_counts($)
+{
+    my ($fh) = @_;
+    my %counts;
+    while (my $line = <$fh>) {
+        chomp $line;
+        next if $line =~ /^#/ || $line eq '';
+        my ($hits, $cell) = split(/\t/, $line, 2);
+        $counts{$cell} += $hits if defined $cell;
+    }
+    return %counts;
+}
+
+sub load_coverage($)
+{
+    # Seed the coverage map from a file written by an earlier run.
+    # A missing file is an empty map.
+    my ($file) = @_;
+    open(my $fh, "<", $file) or return;
+    flock($fh, LOCK_SH);
+    my %counts = read_coverage_counts($fh);
+    close($fh);
+    $coverage{$_} += $counts{$_} for keys %counts;
+}
+
+sub save_coverage($)
+{
+    # Add the hits of this run to the counts in $file. The file is
+    # locked, so concurrent runs can share one coverage file.
+    my ($file) = @_;
+    open(my $fh, "+>>", $file) or die "can't open $file: $!";
+    flock($fh, LOCK_EX) or die "can't lock $file: $!";
+    seek($fh, 0, 0);
+    my %counts = read_coverage_counts($fh);
+    $counts{$_} += $coverage_new{$_} for keys %coverage_new;
+    truncate($fh, 0);
+    seek($fh, 0, 0);
+    print $fh "# risugen coverage: hits<TAB>pattern<TAB>cell\n";
+    print $fh "$counts{$_}\t$_\n" for sort keys %counts;
+    close($fh) or die "can't write $file: $!";
+    %coverage_new = ();
+}
+
+sub coverage_report($@)
+{
+    # Print how many coverage cells of the given patterns were hit.
+    my ($details, @keys) = @_;
+    my ($hit, $total) = (0, 0);
+    my @missed;
+    for my $k (@keys) {
+        my $rec = $details->{$k};
+        next if !defined $rec->{covfields};
+        my $cells = 0;
+        for my $f (@{ $rec->{covfields} }) {
+            $cells += @{ $f->[3] };
+        }
+        my $miss = uncovered_cells($rec);
+        $total += $cells;
+        $hit += $cells - $miss;
+        push @missed, sprintf("  %-40s %d/%d cells uncovered", $k, $miss, $cells)
+            if $miss;
+    }
+    printf("Coverage: %d/%d field cells hit\n", $hit, $total);
+    print "$_\n" for @missed;
+    for my $p (1, 2, 4) {
+        my @fp = grep { $coverage{"fp$p\t$_->[0]"} } @fp_classes;
+        printf("  fp%d: %d/%d value classes hit\n", $p, scalar(@fp),
+               scalar(@fp_classes)) if @fp;
+    }
+}
+
+sub random_insn_bits($)
+{
+    # Return a random instruction word for the pattern, with the
+    # fixed bits set and any analysed fields drawn from their
+    # valid values.
+    my ($rec) = @_;
+    analyse_constraints($rec) if !defined $rec->{sampler};
+    my $s = $rec->{sampler};
+
+    my $insn = int(rand(0xffffffff));
+    $insn &= ~$rec->{fixedbitmask};
+    $insn |= $rec->{fixedbits};
+
+    if (%{ $s->{domains} }) {
+        for my $tuple (@{ $rec->{fields} }) {
+            my ($var, $pos, $mask) = @$tuple;
+            my $vals = $s->{domains}{$var};
+            next if !defined $vals;
+            $insn &= ~($mask << $pos);
+            $insn |= $vals->[int rand(@$vals)] << $pos;
+        }
+    }
+    $insn = guide_insn_fields($rec, $insn) if $coverage_on;
+    $s->{attempts}++;
+    return $insn;
+}
+
+sub constraints_need_eval($)
+{
+    # True if sampling alone does not guarantee the constraints hold.
+    my ($rec) = @_;
+    return defined $rec->{blocks}{"constraints"} && $rec->{sampler}{residual};
+}
+
+sub note_insn_accepted($$)
+{
+    my ($rec, $insn) = @_;
+    $rec->{sampler}{accepted}++;
+    note_insn_coverage($rec, $insn) if $coverage_on;
+}
+
+sub constraint_stats_report($@)
+{
+    # Print the acceptance rate of the generated patterns.
+    my ($details, @keys) = @_;
+    print "Pattern acceptance rates:\n";
+    for my $k (@keys) {
+        my $s = $details->{$k}{sampler};
+        next if !defined $s || !$s->{attempts};
+        my $how = $s->{residual} ? "retry" : "sampled";
+        $how .= " [" . join(",", sort keys %{ $s->{domains} }) . "]"
+            if %{ $s->{domains} };
+        printf("  %-40s %8d/%-8d %6.2f%%  %s\n", $k, $s->{accepted},
+               $s->{attempts}, 100.0 * $s->{accepted} / $s->{attempts}, $how);
+    }
+}
+
 sub is_pow_of_2($)
 {
     my ($x) = @_;
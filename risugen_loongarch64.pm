@@ -34,10 +34,13 @@ my $OP_TESTEND = 1;        # end of test, stop
 my $OP_SETMEMBLOCK = 2;    # r4 is address of memory block (8192 bytes)
 my $OP_GETMEMBLOCK = 3;    # add the address of memory block to r4
 my $OP_COMPAREMEM = 4;     # compare memory block
+my $OP_BENCHSTART = 5;     # start of benchmark loop (param is insn count)
+my $OP_BENCHLOOP = 6;      # end of benchmark loop
 
 sub write_risuop($)
 {
     my ($op) = @_;
+    note_risuop($op);
     insn32(0x000001f0 | $op);
 }
 
@@ -242,6 +245,7 @@ sub write_jump_fwd($)
 
 sub write_memblock_setup()
 {
+    note_symbol("risu_memblock_setup");
     my $align = $MAXALIGN;
     my $datalen = 8192 + $align;
     if (($align > 255) || !is_pow_of_2($align) || $align < 4) {
@@ -255,6 +259,7 @@ sub write_memblock_setup()
     write_risuop($OP_SETMEMBLOCK);           #insn 3
     write_jump_fwd($datalen);                #insn 4
 
+    note_symbol("risu_memblock");
     for(my $i = 0; $i < $datalen / 4; $i++) {
         insn32(rand(0xffffffff));
     }
@@ -271,22 +276,22 @@ sub write_random_fpreg_var($)
     }
 
     my ($low, $high);
-    my $r = rand(100);
-    if ($r < 5) {
+    my $class = pick_fp_class($precision);
+    if ($class eq "zero") {
         # +-0 (5%)
         $low = $high = 0;
         $high |= 0x80000000 if (rand() < 0.5);
-    } elsif ($r < 10) {
+    } elsif ($class eq "nan") {
         # NaN (5%)
         # (plus a tiny chance of generating +-Inf)
         $randomize_low = 1;
         $high = rand(0xffffffff) | 0x7ff00000;
-    } elsif ($r < 15) {
+    } elsif ($class eq "inf") {
         # Infinity (5%)
         $low = 0;
         $high = 0x7ff00000;
         $high |= 0x80000000 if (rand() < 0.5);
-    } elsif ($r < 30) {
+    } elsif ($class eq "denormal") {
         # Denormalized number (15%)
         # (plus tiny chance of +-0)
         $randomize_low = 1;
@@ -361,10 +366,11 @@ sub write_random_regdata()
     }
 }
 
-sub write_random_register_data($)
+sub write_random_register_data($$)
 {
-    my ($fp_enabled) = @_;
+    my ($fp_enabled, $compare) = @_;
 
+    note_symbol("risu_reinit");
     # Set fcc0 ~ fcc7
     # movgr2cf $fcc0, $zero
     insn32(0x114d800);
@@ -399,7 +405,7 @@ sub write_random_register_data($)
     }
 
     write_random_regdata();
-    write_risuop($OP_COMPARE);
+    write_risuop($OP_COMPARE) if $compare;
 }
 
 sub gen_one_insn($$)
@@ -409,7 +415,7 @@ sub gen_one_insn($$)
 
     INSN: while(1) {
         my ($forcecond, $rec) = @_;
-        my $insn = int(rand(0xffffffff));
+        my $insn = random_insn_bits($rec);
         my $insnname = $rec->{name};
         my $insnwidth = $rec->{width};
         my $fixedbits = $rec->{fixedbits};
@@ -418,10 +424,8 @@ sub gen_one_insn($$)
         my $memblock = $rec->{blocks}{"memory"};
         my $post = $rec->{blocks}{"post"};
 
-        $insn &= ~$fixedbitmask;
-        $insn |= $fixedbits;
 
-        if (defined $constraint) {
+        if (constraints_need_eval($rec)) {
             # User-specified constraint: evaluate in an environment
             # with variables set corresponding to the variable fields.
             my $v = eval_with_fields($insnname, $insn, $rec, "constraints", $constraint);
@@ -437,10 +441,12 @@ sub gen_one_insn($$)
 
         # OK, we got a good one
         $constraintfailures = 0;
+        note_insn_accepted($rec, $insn);
 
         my $basereg;
 
         if (defined $memblock) {
+            note_symbol("risu_memsetup");
             # This is a load or store. We simply evaluate the block,
             # which is expected to be a call to a function which emits
             # the code to set up the base register and returns the
@@ -451,6 +457,7 @@ sub gen_one_insn($$)
             $basereg = eval_with_fields($insnname, $insn, $rec, "memory", $memblock);
         }
 
+        note_insn_offset($rec);
         insn32($insn);
 
         if (defined $post) {
@@ -469,7 +476,7 @@ sub gen_one_insn($$)
             if ($basereg != -1) {
                 write_mov_ri($basereg, 0);
             }
-            write_risuop($OP_COMPAREMEM);
+            write_risuop($OP_COMPAREMEM) if !defer_memcompare();
         }
         return;
     }
@@ -482,6 +489,9 @@ sub write_test_code($)
     my $condprob = $params->{ 'condprob' };
     my $fcsr = $params->{'fpscr'};
     my $numinsns = $params->{ 'numinsns' };
+    my $seed = $params->{ 'seed' };
+    my $jobs = $params->{ 'jobs' };
+    my $bench = $params->{ 'bench' };
     my $fp_enabled = $params->{ 'fp_enabled' };
     my $outfile = $params->{ 'outfile' };
 
@@ -494,8 +504,7 @@ sub write_test_code($)
     # probability of forcing insn to unconditional
     $condprob = 1 - $condprob;
 
-    # TODO better random number generator?
-    srand(0);
+    set_random_seed($seed);
 
     print "Generating code using patterns: @keys...\n";
     progress_start(78, $numinsns);
@@ -507,20 +516,37 @@ sub write_test_code($)
     if (grep { defined($insn_details{$_}->{blocks}->{"memory"}) } @keys) {
         write_memblock_setup();
     }
+    if ($bench) {
+        # A benchmark image runs the register reinit and the generated
+        # insns in a loop, which risu --bench times. The reinit leaves
+        # out its compare, so that nothing inside the loop traps.
+        write_mov_ri(4, $numinsns);
+        write_risuop($OP_BENCHSTART);
+    }
     # Memblock setup doesn't clean its registers, so this must come afterwards.
-    write_random_register_data($fp_enabled);
+    write_random_register_data($fp_enabled, !$bench);
 
-    for my $i (1..$numinsns) {
-        my $insn_enc = $keys[int rand (@keys)];
+    # Each chunk of 100 insns ends a block and does the periodic register
+    # reinit, which leaves us in the same state as we started the chunk in.
+    write_insn_chunks($numinsns, 100, $jobs, sub {
+        my ($i) = @_;
+        my $insn_enc = pick_insn_key(\@keys, \%insn_details);
         my $forcecond = (rand() < $condprob) ? 1 : 0;
         gen_one_insn($forcecond, $insn_details{$insn_enc});
-        write_risuop($OP_COMPARE);
+        return if $bench;
+        if (insn_ends_block(($i % 100) == 0 || $i == $numinsns)) {
+            write_risuop($OP_COMPAREMEM) if take_deferred_memcompare();
+            write_risuop($OP_COMPARE);
+        }
         # Rewrite the registers periodically. This avoids the tendency
         # for the VFP registers to decay to NaNs and zeroes.
         if ($periodic_reg_random && ($i % 100) == 0) {
-            write_random_register_data($fp_enabled);
+            write_random_register_data($fp_enabled, 1);
         }
-        progress_update($i);
+    });
+    if ($bench) {
+        write_risuop($OP_BENCHLOOP);
+        write_risuop($OP_COMPARE);
     }
     write_risuop($OP_TESTEND);
     progress_end();
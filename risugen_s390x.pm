@@ -69,11 +69,16 @@ sub write_random_regdata()
 
 my $OP_COMPARE = 0;        # compare registers
 my $OP_TESTEND = 1;        # end of test, stop
+my $OP_BENCHSTART = 5;     # start of benchmark loop (param is insn count)
+my $OP_BENCHLOOP = 6;      # end of benchmark loop
 
-sub write_random_register_data()
+sub write_random_register_data($)
 {
+    my ($compare) = @_;
+
+    note_symbol("risu_reinit");
     write_random_regdata();
-    write_risuop($OP_COMPARE);
+    write_risuop($OP_COMPARE) if $compare;
 }
 
 sub gen_one_insn($$)
@@ -83,7 +88,7 @@ sub gen_one_insn($$)
 
     INSN: while(1) {
         my ($forcecond, $rec) = @_;
-        my $insn = int(rand(0xffffffff));
+        my $insn = random_insn_bits($rec);
         my $insnname = $rec->{name};
         my $insnwidth = $rec->{width};
         my $fixedbits = $rec->{fixedbits};
@@ -91,10 +96,8 @@ sub gen_one_insn($$)
         my $constraint = $rec->{blocks}{"constraints"};
         my $memblock = $rec->{blocks}{"memory"};
 
-        $insn &= ~$fixedbitmask;
-        $insn |= $fixedbits;
 
-        if (defined $constraint) {
+        if (constraints_need_eval($rec)) {
             # user-specified constraint: evaluate in an environment
             # with variables set corresponding to the variable fields.
             my $v = eval_with_fields($insnname, $insn, $rec, "constraints", $constraint);
@@ -110,6 +113,7 @@ sub gen_one_insn($$)
 
         # OK, we got a good one
         $constraintfailures = 0;
+        note_insn_accepted($rec, $insn);
 
         my $basereg;
 
@@ -117,6 +121,7 @@ sub gen_one_insn($$)
             die "memblock handling has not been implemented yet."
         }
 
+        note_insn_offset($rec);
         if ($insnwidth == 16) {
             insn16(($insn >> 16) & 0xffff);
         } else {
@@ -130,6 +135,7 @@ sub gen_one_insn($$)
 sub write_risuop($)
 {
     my ($op) = @_;
+    note_risuop($op);
     insn32(0x835a0f00 | $op);
 }
 
@@ -139,6 +145,9 @@ sub write_test_code($)
 
     my $condprob = $params->{ 'condprob' };
     my $numinsns = $params->{ 'numinsns' };
+    my $seed = $params->{ 'seed' };
+    my $jobs = $params->{ 'jobs' };
+    my $bench = $params->{ 'bench' };
     my $outfile = $params->{ 'outfile' };
 
     my %insn_details = %{ $params->{ 'details' } };
@@ -152,8 +161,7 @@ sub write_test_code($)
     # probability of forcing insn to unconditional
     $condprob = 1 - $condprob;
 
-    # TODO better random number generator?
-    srand(0);
+    set_random_seed($seed);
 
     print "Generating code using patterns: @keys...\n";
     progress_start(78, $numinsns);
@@ -162,21 +170,37 @@ sub write_test_code($)
         write_memblock_setup();
     }
 
+    if ($bench) {
+        # A benchmark image runs the register reinit and the generated
+        # insns in a loop, which risu --bench times. The reinit leaves
+        # out its compare, so that nothing inside the loop traps.
+        write_mov_ri(0, 0, $numinsns);
+        write_risuop($OP_BENCHSTART);
+    }
     # memblock setup doesn't clean its registers, so this must come afterwards.
-    write_random_register_data();
+    write_random_register_data(!$bench);
 
-    for my $i (1..$numinsns) {
-        my $insn_enc = $keys[int rand (@keys)];
+    # Each chunk of 100 insns ends a block and does the periodic register
+    # reinit, which leaves us in the same state as we started the chunk in.
+    write_insn_chunks($numinsns, 100, $jobs, sub {
+        my ($i) = @_;
+        my $insn_enc = pick_insn_key(\@keys, \%insn_details);
         #dump_insn_details($insn_enc, $insn_details{$insn_enc});
         my $forcecond = (rand() < $condprob) ? 1 : 0;
         gen_one_insn($forcecond, $insn_details{$insn_enc});
-        write_risuop($OP_COMPARE);
+        return if $bench;
+        if (insn_ends_block(($i % 100) == 0 || $i == $numinsns)) {
+            write_risuop($OP_COMPARE);
+        }
         # Rewrite the registers periodically. This avoids the tendency
         # for the VFP registers to decay to NaNs and zeroes.
         if ($periodic_reg_random && ($i % 100) == 0) {
-            write_random_register_data();
+            write_random_register_data(1);
         }
-        progress_update($i);
+    });
+    if ($bench) {
+        write_risuop($OP_BENCHLOOP);
+        write_risuop($OP_COMPARE);
     }
     write_risuop($OP_TESTEND);
     progress_end();
@@ -0,0 +1,180 @@
+/******************************************************************************
+ * Copyright (c) 2026 The risu authors
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * which accompanies this distribution, and is available at
+ * http://www.eclipse.org/legal/epl-v10.html
+ *****************************************************************************/
+
+/*
+ * Trace server for --serve-trace.
+ *
+ * Each apprentice which connects is sent the recorded trace over the
+ * socket just as a master would have sent it live, so the apprentice
+ * side needs nothing new. Every connection has a thread of its own
+ * reading the trace file from the start, so any number of apprentices
+ * can run against one server at once, each at its own pace. Records
+ * are passed on without being looked into, so the server need not
+ * run on the architecture the trace was recorded on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "librisu.h"
+
+/* Much more than the largest reginfo (SVE with ZA) or memory block. */
+#define MAX_PAYLOAD     (1 << 20)
+
+typedef struct {
+    int sock;
+    const char *trace_fn;
+    uint64_t image_hash;
+    char peer[NI_MAXHOST + NI_MAXSERV + 2];
+} Client;
+
+static void *serve_client(void *opaque)
+{
+    Client *c = opaque;
+    RisuOptions opts = { .trace = true, .fd = -1 };
+    const trace_header_t *header;
+    trace_header_t h = { 0 };
+    uint8_t *payload = malloc(MAX_PAYLOAD);
+    uint64_t records = 0;
+    RisuContext *ctx = NULL;
+    RisuResult res;
+    const char *why;
+    /*
+     * Say nothing about the architecture, which the apprentice then
+     * doesn't check, nor about the image unless we were given it, and
+     * offer no optional features: records go out as they are in the
+     * trace.
+     */
+    risu_hello_t hello = {
+        .magic = RISU_HELLO_MAGIC,
+        .version = RISU_PROTOCOL_VERSION,
+        .memblock_size = MEMBLOCKLEN,
+        .image_hash = c->image_hash,
+    };
+    uint32_t features;
+
+    if (risu_handshake(c->sock, true, &hello, &features) != RES_OK) {
+        why = "handshake failed";
+        goto out;
+    }
+
+    opts.fd = open(c->trace_fn, O_RDONLY);
+    if (opts.fd < 0 || !payload || !(ctx = risu_new(&opts))) {
+        why = strerror(errno);
+        goto out;
+    }
+
+    for (;;) {
+        res = risu_read_raw_record(ctx, payload, MAX_PAYLOAD, &header);
+        if (res != RES_OK) {
+            why = "trace unreadable";
+            break;
+        }
+        /* The apprentice answers each packet, with RES_END to stop. */
+        h = *header;
+        res = try_send_data_pkt(c->sock, &h, sizeof(h));
+        if (res == RES_OK && h.size) {
+            res = try_send_data_pkt(c->sock, payload, h.size);
+        }
+        records++;
+        if (res == RES_END) {
+            why = h.risu_op == OP_TESTEND ? "end of test"
+                                          : "apprentice stopped";
+            break;
+        }
+        if (res != RES_OK) {
+            why = "connection lost";
+            break;
+        }
+    }
+
+ out:
+    fprintf(stderr, "serve-trace: %s: %s after %" PRIu64 " records\n",
+            c->peer, why, records);
+    if (ctx) {
+        risu_free(ctx);
+    } else if (opts.fd >= 0) {
+        close(opts.fd);
+    }
+    close(c->sock);
+    free(payload);
+    free(c);
+    return NULL;
+}
+
+int serve_trace(const char *trace_fn, int port, uint64_t image_hash)
+{
+    pthread_attr_t attr;
+    int sock, fd;
+
+    /* Fail now rather than for each apprentice. */
+    fd = open(trace_fn, O_RDONLY);
+    if (fd < 0) {
+        perror(trace_fn);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    /* An apprentice going away must not take the server with it. */
+    signal(SIGPIPE, SIG_IGN);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    sock = master_listen(port);
+    fprintf(stderr, "serve-trace: serving %s on port %d\n", trace_fn, port);
+
+    for (;;) {
+        struct sockaddr_storage sa;
+        socklen_t salen = sizeof(sa);
+        char host[NI_MAXHOST], serv[NI_MAXSERV];
+        pthread_t thread;
+        Client *c;
+        int nsock;
+
+        nsock = accept(sock, (struct sockaddr *) &sa, &salen);
+        if (nsock < 0) {
+            if (errno != EINTR) {
+                /* e.g. out of fds: let the running clients finish */
+                perror("accept");
+                sleep(1);
+            }
+            continue;
+        }
+
+        c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(nsock);
+            continue;
+        }
+        c->sock = nsock;
+        c->trace_fn = trace_fn;
+        c->image_hash = image_hash;
+        if (getnameinfo((struct sockaddr *) &sa, salen, host, sizeof(host),
+                        serv, sizeof(serv),
+                        NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            snprintf(c->peer, sizeof(c->peer), "%s:%s", host, serv);
+        } else {
+            snprintf(c->peer, sizeof(c->peer), "fd %d", nsock);
+        }
+        fprintf(stderr, "serve-trace: %s: connected\n", c->peer);
+
+        if (pthread_create(&thread, &attr, serve_client, c) != 0) {
+            fprintf(stderr, "serve-trace: %s: no thread for it\n", c->peer);
+            close(nsock);
+            free(c);
+        }
+    }
+}